@@ -0,0 +1,166 @@
+/*
+ * FILE:
+ * opencog/persist/cog-common/ListStream.h
+ *
+ * FUNCTION:
+ * Incremental splitting of S-Expression lists, as they arrive.
+ *
+ * HISTORY:
+ * Copyright (c) 2020 Linas Vepstas <linasvepstas@gmail.com>
+ *
+ * LICENSE:
+ * SPDX-License-Identifier: AGPL-3.0-or-later
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License v3 as
+ * published by the Free Software Foundation and including the exceptions
+ * at http://opencog.org/wiki/Licenses
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program; if not, write to:
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef _OPENCOG_COG_LIST_STREAM_H
+#define _OPENCOG_COG_LIST_STREAM_H
+
+#include <string>
+
+namespace opencog
+{
+
+// Streamed replies are handed out in pieces of about this size.
+#define STREAM_WINDOW 65536
+
+/**
+ * Replies such as those to `cog-get-atoms` are one big list,
+ * `(atom atom atom ...)` followed by a newline. These can be huge.
+ * Rather than waiting for the whole thing to arrive, the bytes are
+ * fed in here, as they come off the socket. The complete elements
+ * of the list can be taken out at any time, wrapped up as a (smaller)
+ * list, ready for decoding. Only the incomplete tail is kept back.
+ *
+ * Replies that are not lists (e.g. error messages) are passed
+ * through as-is, once the terminating newline shows up.
+ */
+class ListStream
+{
+	private:
+		std::string _buf;   // Inside of the list, not yet taken.
+		size_t _done;       // End of the last complete element in _buf.
+		int _depth;         // Paren depth.
+		bool _quote;        // Inside a string literal.
+		bool _escape;       // Previous char was a backslash.
+		bool _started;      // Got the first non-blank char.
+		bool _is_list;      // Reply started with an open-paren.
+		bool _complete;     // Got the terminating newline.
+
+	public:
+		ListStream(void) { reset(); }
+
+		void reset(void)
+		{
+			_buf.clear();
+			_done = 0;
+			_depth = 0;
+			_quote = false;
+			_escape = false;
+			_started = false;
+			_is_list = false;
+			_complete = false;
+		}
+
+		/// Scan the bytes. Returns how many were used; this is less
+		/// than `len` only if the reply ended part-way through.
+		size_t feed(const char* p, size_t len)
+		{
+			size_t i = 0;
+			while (i < len and not _complete)
+			{
+				char c = p[i++];
+
+				// Synchronous idle chars, from a congested cogserver.
+				if (0x16 == c) continue;
+
+				// Whether or not this is a list is decided by the first
+				// char. Anything else (e.g. an error message, which might
+				// well have parens in it) is passed through as-is, up to
+				// the newline.
+				if (not _started)
+				{
+					if (' ' == c or '\t' == c or '\r' == c) continue;
+					_started = true;
+					_is_list = ('(' == c);
+				}
+				if (not _is_list)
+				{
+					_buf.push_back(c);
+					if ('\n' != c) continue;
+					_complete = true;
+					_done = _buf.size();
+					break;
+				}
+
+				bool keep = (0 < _depth);
+				bool closed = false;
+				if (_quote)
+				{
+					if (_escape) _escape = false;
+					else if ('\\' == c) _escape = true;
+					else if ('"' == c) _quote = false;
+				}
+				else if ('"' == c) _quote = true;
+				else if ('(' == c)
+				{
+					// The opening paren of the list itself is not kept.
+					if (0 == _depth) keep = false;
+					_depth++;
+				}
+				else if (')' == c and 0 < _depth)
+				{
+					_depth--;
+					if (0 == _depth) keep = false;
+					closed = (1 == _depth);
+				}
+				else if ('\n' == c and 0 == _depth)
+				{
+					_complete = true;
+					_done = _buf.size();
+					break;
+				}
+
+				if (keep) _buf.push_back(c);
+				if (closed) _done = _buf.size();
+			}
+			return i;
+		}
+
+		bool complete(void) const { return _complete; }
+
+		/// Number of bytes of complete elements, ready to be taken.
+		size_t ready(void) const { return _done; }
+
+		/// Take out the complete elements, wrapped up as a list.
+		/// Once the reply is complete, this takes out everything.
+		std::string take(void)
+		{
+			std::string elts;
+			if (_is_list)
+				elts = "(" + _buf.substr(0, _done) + ")";
+			else
+				elts = _buf.substr(0, _done);
+			_buf.erase(0, _done);
+			_done = 0;
+			return elts;
+		}
+};
+
+} // namespace opencog
+
+#endif // _OPENCOG_COG_LIST_STREAM_H
@@ -21,6 +21,8 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include "ListStream.h"
+
 using namespace opencog;
 
 /**
@@ -73,4 +75,75 @@ void CLASSNAME::ro_decode_alist(AtomSpace* as,
 	}
 }
 
+/**
+ * Decode a batch of Valuation association lists, one per line, as
+ * returned for a message holding many `cog-keys->alist` requests.
+ * The n'th alist is placed onto the n'th atom.
+ */
+void CLASSNAME::decode_alist_batch(AtomSpace* as,
+                                   const HandleSeq& atoms,
+                                   const std::string& alists)
+{
+	size_t pos = 0;
+	for (const Handle& atom : atoms)
+	{
+		size_t nl = alists.find('\n', pos);
+		if (std::string::npos == nl) nl = alists.size();
+		ro_decode_alist(as, atom, alists.substr(pos, nl-pos));
+		pos = nl+1;
+		if (alists.size() <= pos) break;
+	}
+}
+
+/**
+ * Decode a batch of Values, one per line, as returned for a message
+ * holding many `cog-value` requests. The n'th Value is placed onto
+ * the n'th atom, at the n'th key.
+ */
+void CLASSNAME::decode_value_batch(const HandleSeq& atoms,
+                                   const HandleSeq& keys,
+                                   const std::string& values)
+{
+	size_t pos = 0;
+	for (size_t i=0; i<atoms.size(); i++)
+	{
+		size_t nl = values.find('\n', pos);
+		if (std::string::npos == nl) nl = values.size();
+		size_t vpos = 0;
+		ValuePtr vp = Sexpr::decode_value(values.substr(pos, nl-pos), vpos);
+
+		// If the Value has Atoms inside of it, make sure they
+		// live in an AtomSpace.
+		AtomSpace* as = atoms[i]->getAtomSpace();
+		if (as)
+			vp = Sexpr::add_atoms(as, vp);
+		atoms[i]->setValue(keys[i], vp);
+
+		pos = nl+1;
+		if (values.size() <= pos) break;
+	}
+}
+
+/**
+ * Decode a batch of `#t` or `#f` replies, one per line, as returned
+ * for a message holding many `cog-extract!` requests. Anything that
+ * is not `#t` (e.g. an error message) counts as a failure.
+ */
+std::vector<bool> CLASSNAME::decode_bool_batch(size_t n,
+                                               const std::string& bools)
+{
+	std::vector<bool> oks(n, false);
+	size_t pos = 0;
+	for (size_t i=0; i<n; i++)
+	{
+		size_t nl = bools.find('\n', pos);
+		if (std::string::npos == nl) nl = bools.size();
+		oks[i] = (0 == bools.compare(pos, 2, "#t"));
+
+		pos = nl+1;
+		if (bools.size() <= pos) break;
+	}
+	return oks;
+}
+
 /* ============================= END OF FILE ================= */
@@ -51,7 +51,9 @@ using namespace opencog;
 // send-recv pair.  This is so that mutiple threads sharing the same
 // socket do not accidentally get confused about whose data is whose.
 // If you want faster throughput, then open multiple sockets to the
-// cogserver, it can handle that just fine.
+// cogserver, it can handle that just fine. Or use the pipelined mode:
+// then the lock is held only for the send, and do_call() matches up
+// the replies with the callers.
 
 void CogSimpleStorage::set_proxy(const Handle& h)
 {
@@ -64,11 +66,8 @@ void CogSimpleStorage::set_proxy(const Handle& h)
 	std::string msg =
 		"(cog-set-proxy! " + Sexpr::encode_atom(h, false) + ")\n";
 
-	std::lock_guard<std::mutex> lck(_mtx);
-	do_send(msg);
-
 	// Flush the response.
-	do_recv();
+	do_call(msg);
 }
 
 void CogSimpleStorage::storeAtom(const Handle& h, bool synchronous)
@@ -137,10 +136,7 @@ void CogSimpleStorage::loadValue(const Handle& h, const Handle& key)
 	msg = "(cog-value " + Sexpr::encode_atom(h) +
 	      Sexpr::encode_atom(key) + ")\n";
 
-	std::lock_guard<std::mutex> lck(_mtx);
-	do_send(msg);
-
-	std::string rply = do_recv();
+	std::string rply = do_call(msg);
 	size_t pos = 0;
 	ValuePtr vp = Sexpr::decode_value(rply, pos);
 
@@ -160,51 +156,53 @@ void CogSimpleStorage::removeAtom(AtomSpace* frame, const Handle& h, bool recurs
 	else
 		msg = "(cog-extract! " + Sexpr::encode_atom(h) + ")\n";
 
-	std::lock_guard<std::mutex> lck(_mtx);
-	do_send(msg);
-
 	// Flush the response.
-	do_recv();
+	do_call(msg);
 }
 
-void CogSimpleStorage::getAtom(const Handle& h)
+// Many deletes per message, with all of the replies coming back
+// together, instead of one round trip for each atom.
+std::vector<bool> CogSimpleStorage::removeAtoms(AtomSpace* frame,
+                                                const HandleSeq& hs,
+                                                bool recursive)
 {
-	std::string typena = nameserver().getTypeName(h->get_type()) + " ";
-	std::string iknow;
-	if (h->is_node())
-	{
-		typena += "\"" + h->get_name() + "\"";
-		iknow = "(cog-node '" + typena + ")\n";
-	}
-	else
+	std::string cmd = recursive ? "(cog-extract-recursive! " : "(cog-extract! ";
+	std::vector<bool> oks;
+	std::string msg;
+	size_t nbatch = 0;
+	for (size_t i=0; i<hs.size(); i++)
 	{
-		for (const Handle& ho: h->getOutgoingSet())
-			typena += Sexpr::encode_atom(ho);
-		iknow = "(cog-link '" + typena + ")\n";
+		msg += cmd + Sexpr::encode_atom(hs[i]) + ")\n";
+		nbatch++;
+		if (_batch_bytes < msg.size() or i+1 == hs.size())
+		{
+			std::vector<bool> bs =
+				decode_bool_batch(nbatch, do_call(msg, nbatch));
+			oks.insert(oks.end(), bs.begin(), bs.end());
+			msg.clear();
+			nbatch = 0;
+		}
 	}
+	return oks;
+}
 
-	// Does the cogserver even know about this atom?
-	std::lock_guard<std::mutex> lck(_mtx);
-	do_send(iknow);
-	std::string msg = do_recv();
-	if (0 == msg.compare(0, 2, "()")) return;
-
-	// Yes, the cogserver knows about this atom
-	// Get all of the keys.
-	std::string get_keys = "(cog-keys->alist (" + typena + "))\n";
-	do_send(get_keys);
-	msg = do_recv();
+void CogSimpleStorage::getAtom(const Handle& h)
+{
+	// Get all of the keys, in one round trip. If the cogserver
+	// doesn't know about this atom, the reply is an empty list,
+	// the same as for an atom with no values.
+	std::string get_keys = "(cog-keys->alist " + Sexpr::encode_atom(h) + ")\n";
+	std::string msg = do_call(get_keys);
 	// Sexpr::decode_alist(h, msg);
 	ro_decode_alist(_atom_space, h, msg);
 }
 
-void CogSimpleStorage::decode_atom_list(AtomSpace* table)
+// Decode a list of atoms, and add them to the AtomSpace. The handles
+// are appended to `hs`, so that their keys can be fetched later.
+void CogSimpleStorage::decode_atoms(AtomSpace* table,
+                                    const std::string& expr,
+                                    HandleSeq& hs)
 {
-	// XXX FIXME .. this WILL fail if the returned list is large.
-	// Basically, we don't know quite when all the bytes have been
-	// received on the socket... For now, we punt.
-	std::string expr = do_recv();
-
 	// Loop and decode atoms.
 	size_t l = expr.find('(') + 1; // skip the first paren.
 	size_t end = expr.rfind(')');  // trim tailing paren.
@@ -216,16 +214,16 @@ void CogSimpleStorage::decode_atom_list(AtomSpace* table)
 		int pcnt = Sexpr::get_next_expr(expr, l, r, 0);
 		if (l == r) break;
 		if (0 < pcnt) break;
-		Handle h = Sexpr::decode_atom(expr, l, r, 0, _fid_map);
+		// In pipelined mode, this runs on the reader thread, while
+		// loadFrameDAG() may be filling in the frame map.
+		Handle h;
+		{
+			std::lock_guard<std::mutex> flck(_mtx_frame);
+			h = Sexpr::decode_atom(expr, l, r, 0, _fid_map);
+		}
 		if (nullptr == h->getAtomSpace())
 			h = add_nocheck(table, h);
-
-		// Get all of the keys.
-		std::string get_keys = "(cog-keys->alist " + expr.substr(l, r-l+1) + ")\n";
-		do_send(get_keys);
-		std::string msg = do_recv();
-		// Sexpr::decode_alist(h, msg);
-		ro_decode_alist(table, h, msg);
+		hs.push_back(h);
 
 		// advance to next.
 		l = r+1;
@@ -233,21 +231,86 @@ void CogSimpleStorage::decode_atom_list(AtomSpace* table)
 	}
 }
 
+// Rather than asking for the keys on each atom, one at a time,
+// ask for them in batches: one message with many requests in it,
+// with all of the replies coming back together.
+void CogSimpleStorage::fetch_keys(AtomSpace* table, const HandleSeq& hs)
+{
+	std::string get_keys;
+	HandleSeq batch;
+	for (const Handle& h : hs)
+	{
+		get_keys += "(cog-keys->alist " + Sexpr::encode_atom(h) + ")\n";
+		batch.push_back(h);
+		if (_batch_bytes < get_keys.size())
+		{
+			decode_alist_batch(table, batch, do_call(get_keys, batch.size()));
+			get_keys.clear();
+			batch.clear();
+		}
+	}
+	if (0 < batch.size())
+		decode_alist_batch(table, batch, do_call(get_keys, batch.size()));
+}
+
+void CogSimpleStorage::getAtoms(const HandleSeq& hs)
+{
+	fetch_keys(_atom_space, hs);
+}
+
+void CogSimpleStorage::loadValues(const HandleSeq& hs, const Handle& key)
+{
+	loadValues(hs, HandleSeq(hs.size(), key));
+}
+
+// Same idea as fetch_keys(), above: many requests per message.
+void CogSimpleStorage::loadValues(const HandleSeq& hs, const HandleSeq& keys)
+{
+	if (hs.size() != keys.size())
+		throw IOException(TRACE_INFO, "Need one key per atom; got %zu for %zu",
+			keys.size(), hs.size());
+
+	std::string msg;
+	HandleSeq atoms, kbatch;
+	for (size_t i=0; i<hs.size(); i++)
+	{
+		msg += "(cog-value " + Sexpr::encode_atom(hs[i]) +
+		       Sexpr::encode_atom(keys[i]) + ")\n";
+		atoms.push_back(hs[i]);
+		kbatch.push_back(keys[i]);
+		if (_batch_bytes < msg.size() or i+1 == hs.size())
+		{
+			decode_value_batch(atoms, kbatch, do_call(msg, atoms.size()));
+			msg.clear();
+			atoms.clear();
+			kbatch.clear();
+		}
+	}
+}
+
+// The reply is decoded as it arrives, so that a huge list never has
+// to be held in memory all at once. The keys can only be fetched after
+// the list has arrived in full, because the socket is busy until then.
+void CogSimpleStorage::load_atom_list(AtomSpace* table,
+                                      const std::string& msg)
+{
+	HandleSeq hs;
+	do_stream(msg, [&](const std::string& elts)
+		{ decode_atoms(table, elts, hs); });
+	fetch_keys(table, hs);
+}
+
 void CogSimpleStorage::fetchIncomingSet(AtomSpace* table, const Handle& h)
 {
 	std::string atom = "(cog-incoming-set " + Sexpr::encode_atom(h) + ")\n";
-	std::lock_guard<std::mutex> lck(_mtx);
-	do_send(atom);
-	decode_atom_list(table);
+	load_atom_list(table, atom);
 }
 
 void CogSimpleStorage::fetchIncomingByType(AtomSpace* table, const Handle& h, Type t)
 {
 	std::string msg = "(cog-incoming-by-type " + Sexpr::encode_atom(h)
 		+ " '" + nameserver().getTypeName(t) + ")\n";
-	std::lock_guard<std::mutex> lck(_mtx);
-	do_send(msg);
-	decode_atom_list(table);
+	load_atom_list(table, msg);
 }
 
 void CogSimpleStorage::loadAtomSpace(AtomSpace* table)
@@ -255,26 +318,19 @@ void CogSimpleStorage::loadAtomSpace(AtomSpace* table)
 	// If there's a hierarchy of frames, get those first.
 	// loadFrameDAG(); disable for now.
 
-	std::lock_guard<std::mutex> lck(_mtx);
-
 	// Get nodes and links separately, in an effort to get
 	// smaller replies.
 	std::string msg = "(cog-get-atoms 'Node #t)\n";
-	do_send(msg);
-	decode_atom_list(table);
+	load_atom_list(table, msg);
 
 	msg = "(cog-get-atoms 'Link #t)\n";
-	do_send(msg);
-	decode_atom_list(table);
+	load_atom_list(table, msg);
 }
 
 void CogSimpleStorage::loadType(AtomSpace* table, Type t)
 {
 	std::string msg = "(cog-get-atoms '" + nameserver().getTypeName(t) + ")\n";
-
-	std::lock_guard<std::mutex> lck(_mtx);
-	do_send(msg);
-	decode_atom_list(table);
+	load_atom_list(table, msg);
 }
 
 void CogSimpleStorage::storeAtomSpace(const AtomSpace* table)
@@ -287,9 +343,7 @@ void CogSimpleStorage::storeAtomSpace(const AtomSpace* table)
 
 void CogSimpleStorage::kill_data(void)
 {
-	std::lock_guard<std::mutex> lck(_mtx);
-	do_send("(cog-atomspace-clear)\n");
-	do_recv();
+	do_call("(cog-atomspace-clear)\n");
 
 	// Reset multi-space tracking after clearing
 	_multi_space = false;
@@ -315,12 +369,7 @@ void CogSimpleStorage::runQuery(const Handle& query, const Handle& key,
 	}
 	msg += ")\n";
 
-	std::string rply;
-	{
-		std::lock_guard<std::mutex> lck(_mtx);
-		do_send(msg);
-		rply = do_recv();
-	}
+	std::string rply = do_call(msg);
 
 	size_t pos = 0;
 	ValuePtr vp = Sexpr::decode_value(rply, pos);
@@ -391,14 +440,12 @@ HandleSeq CogSimpleStorage::loadFrameDAG(void)
 {
 	_multi_space = true;
 
-	std::lock_guard<std::mutex> lck(_mtx);
-
 	std::string msg = "(cog-atomspace)\n";
-	do_send(msg);
-	std::string rply = do_recv();
+	std::string rply = do_call(msg);
 
 	if (rply.size() < 5) return HandleSeq();
 
+	std::lock_guard<std::mutex> flck(_mtx_frame);
 	size_t pos = 0;
 	Handle top = Sexpr::decode_frame(Handle::UNDEFINED, rply, pos, _fid_map);
 
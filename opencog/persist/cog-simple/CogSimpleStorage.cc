@@ -27,6 +27,8 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
+#include <climits>
 #include <random>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -41,6 +43,7 @@ static int unistd_close(int fd) { return close(fd); }
 
 #include <opencog/persist/cog-types/atom_types.h>
 #include "CogSimpleStorage.h"
+#include "../cog-common/ListStream.h"
 
 using namespace opencog;
 
@@ -68,28 +71,58 @@ void CogSimpleStorage::init(const char * uri)
 		size_t pamp = args.find('&');
 		while (args.npos != pamp)
 		{
-			std::string pcfg = args.substr(0, pamp);
-
-			// Verify acceptable formats (there are none at this time.)
-			throw IOException(TRACE_INFO,
-				"Unknown configuration %s", pcfg.c_str());
-			// _stuff.push_back(pcfg);
-
+			configure(args.substr(0, pamp));
 			args = args.substr(pamp+1);
 			pamp = args.find('&');
 		}
 
 		// Check the last one too.
-		std::string pcfg = args;
+		configure(args);
+	}
+}
+
+/// Verify and apply one `key=value` configuration argument
+/// taken from the URI.
+void CogSimpleStorage::configure(const std::string& pcfg)
+{
+	size_t peq = pcfg.find('=');
+	std::string key = pcfg.substr(0, peq);
+	std::string val;
+	if (pcfg.npos != peq) val = pcfg.substr(peq+1);
+
+	char* end = nullptr;
+	unsigned long num = strtoul(val.c_str(), &end, 10);
+	bool is_num = (0 < val.size() and isdigit(val[0]) and '\0' == *end);
+
+	// Number of replies that may be outstanding on the socket.
+	if (0 == key.compare("pipeline") and is_num)
+		_pipeline = num;
+
+	// Number of bytes of a bulk-load reply to decode at a time.
+	else if (0 == key.compare("window") and is_num and 0 < num)
+		_window = num;
+
+	// Size of the socket receive buffer. SO_RCVBUF takes an int.
+	else if (0 == key.compare("rcvbuf") and is_num and 0 < num)
+	{
+		if (INT_MAX < num)
+			throw IOException(TRACE_INFO,
+				"Receive buffer too large: %s", pcfg.c_str());
+		_rcvbuf = (int) num;
+	}
+
+	// Largest number of bytes of batched requests in one message.
+	else if (0 == key.compare("batch") and is_num and 0 < num)
+		_batch_bytes = num;
+	else
 		throw IOException(TRACE_INFO,
 			"Unknown configuration %s", pcfg.c_str());
-		// _stuff.push_back(pcfg);
-	}
 }
 
 CogSimpleStorage::CogSimpleStorage(std::string uri) :
 	StorageNode(COG_SIMPLE_STORAGE_NODE, std::move(uri)),
-	_sockfd(-1), _multi_space(false)
+	_sockfd(-1), _window(STREAM_WINDOW), _batch_bytes(MAX_BATCH_BYTES),
+	_rcvbuf(0), _pipeline(0), _dead(false), _multi_space(false)
 {
 	init(_name.c_str());
 }
@@ -103,6 +136,9 @@ void CogSimpleStorage::open(void)
 {
 	if (connected()) return;
 
+	// The server may have hung up on the last socket; let go of it.
+	close();
+
 	std::lock_guard<std::mutex> lck(_mtx);
 
 	// We expect the URI to be for the form
@@ -177,6 +213,13 @@ void CogSimpleStorage::open(void)
 		fprintf(stderr, "Error setting sockopt: %s", strerror(errno));
 #endif
 
+	if (0 < _rcvbuf)
+	{
+		rc = setsockopt(_sockfd, SOL_SOCKET, SO_RCVBUF, &_rcvbuf, sizeof(_rcvbuf));
+		if (0 > rc)
+			fprintf(stderr, "Error setting sockopt: %s", strerror(errno));
+	}
+
 	// Get the s-expression shell.
 	std::string eval = "sexpr\n";
 
@@ -203,27 +246,50 @@ void CogSimpleStorage::open(void)
 	do_send("(cog-set-server-mode! #t)\n");
 	do_recv();
 #endif
+
+	// From here on out, all replies are read by the reader.
+	if (0 < _pipeline)
+	{
+		_dead = false;
+		_reader = std::thread(&CogSimpleStorage::pipe_reader, this);
+	}
 }
 
+/// In pipelined mode, the socket is dead once the reader has seen the
+/// server hang up, even though it's still open.
 bool CogSimpleStorage::connected(void)
 {
-	return 0 < _sockfd;
+	if (0 >= _sockfd) return false;
+	if (0 == _pipeline) return true;
+	std::lock_guard<std::mutex> plck(_pipe_mtx);
+	return not _dead;
 }
 
 void CogSimpleStorage::close(void)
 {
+	// There's no one to say goodbye to, if the server hung up. If it
+	// hangs up during the goodbye, the socket still has to be closed.
+	std::exception_ptr ep;
 	if (connected())
 	{
-		proxy_close();
-		unistd_close(_sockfd);
+		try { proxy_close(); }
+		catch (...) { ep = std::current_exception(); }
+	}
+
+	// Shutting down the socket unblocks the reader.
+	if (_reader.joinable())
+	{
+		shutdown(_sockfd, SHUT_RDWR);
+		_reader.join();
 	}
+	if (0 < _sockfd) unistd_close(_sockfd);
 	_sockfd = -1;
+	if (ep) std::rethrow_exception(ep);
 }
 
 void CogSimpleStorage::proxy_open(void)
 {
-	do_send("(cog-proxy-open)\n");
-	do_recv();
+	do_call("(cog-proxy-open)\n");
 }
 
 void CogSimpleStorage::proxy_close(void)
@@ -236,8 +302,7 @@ void CogSimpleStorage::proxy_close(void)
 	// the one used here for CogSimpleStorage, it's not really needed
 	// But I'm going to get paranoid about this, for now.
 	barrier();
-	do_send("(cog-proxy-close)\n");
-	do_recv();
+	do_call("(cog-proxy-close)\n");
 }
 
 /* ================================================================== */
@@ -256,7 +321,9 @@ void CogSimpleStorage::do_send(const std::string& str)
 // If the argument `garbage` is set to true, then assume that
 // the first read contains the CogServer prompt, which is maybe
 // colorized, and is, in any case, not newine teminated.
-std::string CogSimpleStorage::do_recv(bool garbage)
+// If `nreplies` is more than one, then keep reading until that
+// many newline-terminated replies have arrived.
+std::string CogSimpleStorage::do_recv(bool garbage, size_t nreplies)
 {
 	if (not connected())
 		throw IOException(TRACE_INFO, "Not connected to cogserver!");
@@ -269,6 +336,7 @@ std::string CogSimpleStorage::do_recv(bool garbage)
 	// read.
 	std::string rb;
 	bool first_time = true;
+	size_t nlines = 0;
 	while (true)
 	{
 		// Receive 4K bytes of message.
@@ -309,22 +377,264 @@ std::string CogSimpleStorage::do_recv(bool garbage)
 			if (0 == len) continue;
 		}
 
+		nlines += std::count(pbf, buf+len, '\n');
+		bool done = ('\n' == buf[len-1]) and (nreplies <= nlines);
+
 		// Normal short reads are either newline-terminated,
 		// or are reads of the cogserver prompt, which are
 		// blank-space terminated.
-		if (first_time and (('\n' == buf[len-1]) or garbage))
+		if (first_time and (done or garbage))
 			return pbf;
 
 		first_time = false;
 		rb += pbf;
 
 		// newline-terminated strings mean we are done.
-		if ('\n' == buf[len-1])
+		if (done)
 			return rb;
 	}
 	return rb;
 }
 
+/// Send a request, and return the reply to it. In lock-step mode,
+/// the socket is held for the full round-trip. In pipelined mode,
+/// it is held only for the send; other threads can send their
+/// requests while this one waits for its reply. If the message
+/// holds several commands, one per line, then `nreplies` says
+/// how many replies to collect; they are returned all together.
+std::string CogSimpleStorage::do_call(const std::string& msg,
+                                      size_t nreplies)
+{
+	if (0 == _pipeline)
+	{
+		std::lock_guard<std::mutex> lck(_mtx);
+		do_send(msg);
+		return do_recv(false, nreplies);
+	}
+
+	std::future<std::string> fut;
+	{
+		// Holding _mtx keeps the pending list in the same order
+		// as the requests on the wire.
+		std::lock_guard<std::mutex> lck(_mtx);
+		{
+			std::unique_lock<std::mutex> plck(_pipe_mtx);
+			_pipe_cv.wait(plck, [&]{
+				return _dead or _pending.size() < _pipeline; });
+
+			// No reader is left to hand out the reply.
+			if (_dead)
+				throw IOException(TRACE_INFO,
+					"Cogserver closed connection");
+			_pending.push_back({nreplies, std::promise<std::string>(), nullptr});
+			fut = _pending.back().reply.get_future();
+		}
+		try { do_send(msg); }
+		catch (...)
+		{
+			// If the reader gave up on the socket, then it has
+			// already failed this request, along with the rest.
+			std::lock_guard<std::mutex> plck(_pipe_mtx);
+			if (not _dead) _pending.pop_back();
+			throw;
+		}
+	}
+	return fut.get();
+}
+
+/// Send a request whose reply is a list, possibly a very long one.
+/// The list elements are handed to `window` as they arrive, a few
+/// at a time, wrapped up as a list. This avoids holding the entire
+/// reply in memory, and allows decoding to start before the last
+/// byte has arrived. The callback must not talk to the cogserver.
+void CogSimpleStorage::do_stream(const std::string& msg,
+                                 const WindowCB& window)
+{
+	if (0 < _pipeline)
+	{
+		std::future<std::string> fut;
+		{
+			std::lock_guard<std::mutex> lck(_mtx);
+			{
+				std::unique_lock<std::mutex> plck(_pipe_mtx);
+				_pipe_cv.wait(plck, [&]{
+					return _dead or _pending.size() < _pipeline; });
+				if (_dead)
+					throw IOException(TRACE_INFO,
+						"Cogserver closed connection");
+				_pending.push_back({1, std::promise<std::string>(), window});
+				fut = _pending.back().reply.get_future();
+			}
+			try { do_send(msg); }
+			catch (...)
+			{
+				std::lock_guard<std::mutex> plck(_pipe_mtx);
+				if (not _dead) _pending.pop_back();
+				throw;
+			}
+		}
+		fut.get();
+		return;
+	}
+
+	std::lock_guard<std::mutex> lck(_mtx);
+	do_send(msg);
+
+	ListStream lst;
+	std::exception_ptr werr;
+	while (true)
+	{
+		char buf[4096];
+		int len = recv(_sockfd, buf, sizeof(buf), 0);
+		if (0 > len and EINTR == errno) continue;
+		if (0 > len)
+			throw IOException(TRACE_INFO, "Unable to talk to cogserver: %s",
+				strerror(errno));
+		if (0 == len)
+		{
+			unistd_close(_sockfd);
+			_sockfd = 0;
+			throw IOException(TRACE_INFO, "Cogserver unexpectedly closed connection");
+		}
+
+		// If the callback throws, read to the end of the reply anyway,
+		// so that the socket stays in sync.
+		size_t used = 0;
+		bool done = false;
+		try { done = stream_reply(lst, window, buf, len, used); }
+		catch (...)
+		{
+			if (not werr) werr = std::current_exception();
+			done = lst.complete();
+		}
+		if (done) break;
+	}
+	if (werr) std::rethrow_exception(werr);
+}
+
+/// Feed bytes to the list splitter, and hand out whatever is ready.
+/// Sets `used` to the number of bytes used up. Returns true if the
+/// reply is complete; `lst` is then ready for the next one.
+bool CogSimpleStorage::stream_reply(ListStream& lst,
+                                    const WindowCB& window,
+                                    const char* buf, size_t len,
+                                    size_t& used)
+{
+	used = lst.feed(buf, len);
+	while (_window <= lst.ready())
+		window(lst.take());
+
+	if (not lst.complete()) return false;
+
+	window(lst.take());
+	lst.reset();
+	return true;
+}
+
+// Pipelined mode: read replies off of the socket, and hand them
+// to the waiting callers, in the order that the requests were sent.
+// Replies are newline-terminated; a single recv() may hold several
+// replies, or just a fragment of one.
+void CogSimpleStorage::pipe_reader(void)
+{
+	std::string rb;
+	std::string reply;
+	size_t got = 0;
+	ListStream lst;
+	std::exception_ptr werr;
+	while (true)
+	{
+		char buf[4096];
+		int len = recv(_sockfd, buf, sizeof(buf), 0);
+		if (0 > len and EINTR == errno) continue;
+
+		// Socket closed. Anyone still waiting will never get a reply,
+		// and neither will anyone who asks from now on.
+		if (0 >= len)
+		{
+			std::lock_guard<std::mutex> plck(_pipe_mtx);
+			_dead = true;
+			for (auto& pend : _pending)
+				pend.reply.set_exception(std::make_exception_ptr(
+					IOException(TRACE_INFO,
+						"Cogserver unexpectedly closed connection")));
+			_pending.clear();
+			_pipe_cv.notify_all();
+			return;
+		}
+
+		// Ignore synchronous idle chars. The CogServer sends these
+		// when it is congested and is looking for half-open sockets.
+		char* end = std::remove(buf, buf+len, 0x16);
+		rb.append(buf, end-buf);
+
+		size_t start = 0;
+		while (start < rb.size())
+		{
+			// Only this thread pops the pending list; callers only
+			// push onto the back. So the front stays put.
+			Pending* front = nullptr;
+			{
+				std::lock_guard<std::mutex> plck(_pipe_mtx);
+				if (0 < _pending.size()) front = &_pending.front();
+			}
+
+			// The window callback is called unlocked. If it throws,
+			// keep reading until the end of the reply, and then pass
+			// the exception on to the caller.
+			if (front and front->window)
+			{
+				size_t used = 0;
+				bool done = false;
+				try
+				{
+					done = stream_reply(lst, front->window,
+						rb.data() + start, rb.size() - start, used);
+				}
+				catch (...)
+				{
+					if (not werr) werr = std::current_exception();
+					done = lst.complete();
+					if (done) lst.reset();
+				}
+				start += used;
+				if (not done) break;
+
+				std::lock_guard<std::mutex> plck(_pipe_mtx);
+				if (werr) _pending.front().reply.set_exception(werr);
+				else _pending.front().reply.set_value("");
+				werr = nullptr;
+				_pending.pop_front();
+				_pipe_cv.notify_all();
+				continue;
+			}
+
+			size_t nl = rb.find('\n', start);
+			if (rb.npos == nl) break;
+			reply += rb.substr(start, nl+1-start);
+			start = nl+1;
+			got++;
+
+			std::lock_guard<std::mutex> plck(_pipe_mtx);
+			if (0 == _pending.size())
+			{
+				fprintf(stderr, "Error: unexpected reply from cogserver: %s",
+					reply.c_str());
+				reply.clear();
+				got = 0;
+				continue;
+			}
+			if (got < _pending.front().nreplies) continue;
+			_pending.front().reply.set_value(reply);
+			_pending.pop_front();
+			_pipe_cv.notify_all();
+			reply.clear();
+			got = 0;
+		}
+		rb.erase(0, start);
+	}
+}
+
 /* ================================================================== */
 /// Drain the pending store queue. This is a fencing operation; the
 /// goal is to make sure that all writes that occurred before the
@@ -349,7 +659,14 @@ void CogSimpleStorage::barrier(AtomSpace* as)
 
 std::string CogSimpleStorage::monitor(void)
 {
-	return "Connected to " + _uri + "\n";
+	std::string rs = "Connected to " + _uri + "\n";
+	if (0 < _pipeline)
+	{
+		std::lock_guard<std::mutex> plck(_pipe_mtx);
+		rs += "Pipeline depth: " + std::to_string(_pipeline) +
+			"  In flight: " + std::to_string(_pending.size()) + "\n";
+	}
+	return rs;
 }
 
 DEFINE_NODE_FACTORY(CogSimpleStorageNode, COG_SIMPLE_STORAGE_NODE)
@@ -30,6 +30,13 @@
 #ifndef _SIMPLE_COG_STORAGE_H
 #define _SIMPLE_COG_STORAGE_H
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+
 #include <opencog/persist/api/StorageNode.h>
 #include <opencog/persist/cog-types/atom_types.h>
 
@@ -39,27 +46,75 @@ namespace opencog
  *  @{
  */
 
+// Requests for many atoms are batched up into one message, so that
+// the replies come back in one round-trip. The batches are kept small
+// enough to fit into the socket buffers; otherwise, a lock-step client
+// blocked in send() would never get around to reading the replies,
+// and would deadlock the server. This is the default; the `batch=N`
+// URI argument can change it.
+#define MAX_BATCH_BYTES 8192
+
+class ListStream;
+
 class CogSimpleStorage : public StorageNode
 {
 	private:
 		void init(const char *);
+		void configure(const std::string&);
 		std::string _uri;
 
 		// Socket API ... is single-threaded.
 		std::mutex _mtx;
 		int _sockfd;
 		void do_send(const std::string&);
-		std::string do_recv(bool=false);
-
-		void decode_atom_list(AtomSpace*);
+		std::string do_recv(bool=false, size_t=1);
+		std::string do_call(const std::string&, size_t=1);
+
+		// Long list replies are handed to the callback a window
+		// at a time, as they arrive.
+		typedef std::function<void(const std::string&)> WindowCB;
+		void do_stream(const std::string&, const WindowCB&);
+		bool stream_reply(ListStream&, const WindowCB&,
+		                  const char*, size_t, size_t&);
+		size_t _window;
+
+		// Tuning knobs, set from the URI.
+		size_t _batch_bytes;  // Largest batch of requests
+		int _rcvbuf;          // Socket receive buffer size, SO_RCVBUF
+
+		// Pipelined mode. Callers write their requests back-to-back,
+		// and a reader thread hands out the replies, in order, to
+		// the pending callers. Zero means lock-step send-then-receive.
+		size_t _pipeline;
+		std::thread _reader;
+		std::mutex _pipe_mtx;
+		std::condition_variable _pipe_cv;
+		struct Pending
+		{
+			size_t nreplies;
+			std::promise<std::string> reply;
+			WindowCB window; // Set for streamed replies.
+		};
+		std::deque<Pending> _pending;
+		bool _dead;  // The server hung up; the reader is gone.
+		void pipe_reader(void);
+
+		void load_atom_list(AtomSpace*, const std::string&);
+		void decode_atoms(AtomSpace*, const std::string&, HandleSeq&);
+		void fetch_keys(AtomSpace*, const HandleSeq&);
 		void ro_decode_alist(AtomSpace*, const Handle&, const std::string&);
+		void decode_alist_batch(AtomSpace*, const HandleSeq&,
+		                        const std::string&);
+		std::vector<bool> decode_bool_batch(size_t, const std::string&);
+		void decode_value_batch(const HandleSeq&, const HandleSeq&,
+		                        const std::string&);
 
 		// True if working with more than one atomspace.
 		bool _multi_space;
 		// The Handles are *always* AtomSpacePtr's
 		std::unordered_map<Handle, const std::string> _frame_map;
 		std::unordered_map<std::string, Handle> _fid_map;
-		std::mutex _mtx_frame;
+		std::mutex _mtx_frame;  // Guards both of the maps above.
 		void cacheFrame(const Handle&);
 		std::string writeFrame(const Handle&);
 		std::string writeFrame(AtomSpace* as) {
@@ -107,6 +162,18 @@ class CogSimpleStorage : public StorageNode
 		void storeFrameDAG(AtomSpace*); // Store AtomSpace DAG
 		void barrier(AtomSpace* = nullptr);
 
+		// Batched fetches. Many atoms go out in one message, and come
+		// back in one reply, instead of one round trip for each. The
+		// n'th key is fetched from the n'th atom.
+		void getAtoms(const HandleSeq&);
+		void loadValues(const HandleSeq& atoms, const HandleSeq& keys);
+		void loadValues(const HandleSeq& atoms, const Handle& key);
+
+		// Batched delete; the n'th entry is true if the n'th atom
+		// was removed from the cogserver.
+		std::vector<bool> removeAtoms(AtomSpace*, const HandleSeq&,
+		                              bool recursive);
+
 		// Debugging and performance monitoring
 		std::string monitor(void);
 };
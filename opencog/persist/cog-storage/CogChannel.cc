@@ -27,6 +27,8 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <algorithm>
+#include <iterator>
 #include <random>
 #include <string.h>
 #include <sys/types.h>
@@ -37,6 +39,7 @@
 #include <unistd.h>
 
 #include <opencog/util/exceptions.h>
+#include "../cog-common/ListStream.h"
 #include <opencog/persist/cog-storage/CogChannel.h>
 
 using namespace opencog;
@@ -44,8 +47,11 @@ using namespace opencog;
 /* ================================================================ */
 // Constructors
 
-// Number of threads to run.
-#define NTHREADS 4
+// Number of threads to run, unless the URI says otherwise.
+#define DEFAULT_NTHREADS 4
+
+// Longest time, in milliseconds, that batched writes are held back.
+#define DEFAULT_WDELAY 5
 
 template<typename Client, typename Data>
 std::atomic<size_t> CogChannel<Client, Data>::Msg::_sequence_counter{0};
@@ -53,15 +59,191 @@ std::atomic<size_t> CogChannel<Client, Data>::Msg::_sequence_counter{0};
 template<typename Client, typename Data>
 CogChannel<Client, Data>::CogChannel(void) :
 	_servinfo(nullptr),
-	_msg_buffer(this, &CogChannel::reply_handler, NTHREADS)
+	_nthreads(DEFAULT_NTHREADS),
+	_hiwat(0),
+	_lowat(0),
+	_rcvbuf(0),
+	_ndecode(0),
+	_wbatch(0),
+	_wdelay(DEFAULT_WDELAY),
+	_idle_secs(0),
+	_jan_stop(false),
+	_fencing(false),
+	_nreaders(0),
+	_affinity(false),
+	_on_error(nullptr),
+	_pipeline(0),
+	_window(STREAM_WINDOW)
+{
+	set_shards(1);
+}
+
+/// Split the message queue into `n` shards. The worker threads are
+/// divided up among them; so there can be at most _nthreads shards.
+/// Must be called before the connection is opened.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::set_shards(size_t n)
+{
+	if (0 == n or _nthreads < n)
+		throw IOException(TRACE_INFO,
+			"Number of shards must be between 1 and %zu", _nthreads);
+	if (_affinity and _nthreads != n)
+		throw IOException(TRACE_INFO,
+			"Affinity mode needs one shard per thread");
+
+	_shards.clear();
+	for (size_t i=0; i<n; i++)
+	{
+		_shards.emplace_back(new MsgBuffer(this,
+			&CogChannel::reply_handler, shard_threads(i, n)));
+		apply_watermarks(*_shards.back());
+	}
+}
+
+/// Number of worker threads for the i'th of n shards. The left-over
+/// threads are spread over the first few shards.
+template<typename Client, typename Data>
+int CogChannel<Client, Data>::shard_threads(size_t i, size_t n)
+{
+	return _nthreads / n + (i < _nthreads % n ? 1 : 0);
+}
+
+/// Set the number of worker threads; each one has its own socket.
+/// The shards are rebuilt, keeping as many as there were, if possible.
+/// Must be called before the connection is opened.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::set_threads(size_t n)
+{
+	if (0 == n)
+		throw IOException(TRACE_INFO, "Need at least one thread");
+
+	_nthreads = n;
+	size_t nshards = _affinity ? n : std::min(n, _shards.size());
+	bool aff = _affinity;
+	_affinity = false;
+	set_shards(nshards);
+	_affinity = aff;
+}
+
+/// The queue stalls the producers when it grows past the high
+/// watermark, until it has drained down to the low watermark.
+/// Zero leaves the existing value as it is. The two can be set one
+/// at a time, so the pair is only checked by check_watermarks().
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::set_watermarks(size_t high, size_t low)
 {
+	if (high) _hiwat = high;
+	if (low) _lowat = low;
+	for (auto& sh : _shards) apply_watermarks(*sh);
+	if (_reads) apply_watermarks(*_reads);
+}
+
+/// A high watermark at or below the low one would stall the
+/// producers forever. This includes a high watermark, given alone,
+/// that is below the default low watermark.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::check_watermarks(void)
+{
+	if (0 == _hiwat and 0 == _lowat) return;
+	size_t hi = _hiwat ? _hiwat : _shards[0]->get_high_watermark();
+	size_t lo = _lowat ? _lowat : _shards[0]->get_low_watermark();
+	if (hi <= lo)
+		throw IOException(TRACE_INFO,
+			"High watermark %zu must be above the low watermark %zu",
+			hi, lo);
+}
+
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::apply_watermarks(MsgBuffer& sh)
+{
+	if (0 == _hiwat and 0 == _lowat) return;
+	size_t hi = _hiwat ? _hiwat : sh.get_high_watermark();
+	size_t lo = _lowat ? _lowat : sh.get_low_watermark();
+
+	// Not a usable pair (yet); see check_watermarks().
+	if (hi <= lo) return;
+	sh.set_watermarks(hi, lo);
+}
+
+/// Affinity mode. Each shard gets just one thread, and so one socket,
+/// and messages are handed out in the order they were queued. Then,
+/// by sending all messages about a given Atom to the same shard,
+/// they are also handled by the cogserver in that order. Messages
+/// about different Atoms still go out in parallel. The price is that
+/// duplicate messages are no longer merged.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::set_affinity(bool on)
+{
+	if (on and 0 < _nreaders)
+		throw IOException(TRACE_INFO,
+			"Affinity mode can't have a separate read lane");
+	_affinity = false;
+	set_shards(on ? _nthreads : 1);
+	_affinity = on;
+}
+
+/// Give the fetches (see enqueue_fetch()) `n` worker threads of their
+/// own. Reads then don't wait behind writes. This can't be combined
+/// with affinity mode, which needs reads and writes to stay in order.
+/// Must be called before the connection is opened.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::set_readers(size_t n)
+{
+	if (_affinity and 0 < n)
+		throw IOException(TRACE_INFO,
+			"Affinity mode can't have a separate read lane");
+	_nreaders = n;
+	_reads.reset();
+	if (0 == n) return;
+	_reads.reset(new MsgBuffer(this, &CogChannel::reply_handler, n));
+	apply_watermarks(*_reads);
+}
+
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::insert(Msg& block, size_t affinity)
+{
+	if (_in_reply) _requeued++;
+	if (_reads and block.fetch)
+	{
+		_reads->insert(block);
+		return;
+	}
+
+	if (not _affinity)
+	{
+		shard(block).insert(block);
+		return;
+	}
+
+	// Messages not about any one Atom go by content, as usual.
+	block.order = ++Msg::_sequence_counter;
+	size_t hash = affinity ? affinity : block.hash;
+	_shards[hash % _shards.size()]->insert(block);
+}
+
+template<typename Client, typename Data>
+size_t CogChannel<Client, Data>::queue_size(void)
+{
+	size_t sz = 0;
+	for (const auto& sh : _shards) sz += sh->get_size();
+	if (_reads) sz += _reads->get_size();
+	return sz;
 }
 
 template<typename Client, typename Data>
 CogChannel<Client, Data>::~CogChannel()
 {
 	close_connection();
-	freeaddrinfo((struct addrinfo*) _servinfo);
+	stop_decoders();
+	free_servinfo();
+}
+
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::free_servinfo(void)
+{
+	if (nullptr == _servinfo) return;
+	freeaddrinfo((struct addrinfo *) _servinfo);
+	_servinfo = nullptr;
 }
 
 /* ================================================================ */
@@ -74,12 +256,14 @@ void CogChannel<Client, Data>::open_connection(const std::string& uri)
 		throw IOException(TRACE_INFO, "Unknown URI '%s'\n", uri.c_str());
 
 	_uri = uri;
+	check_watermarks();
 
 	// We expect the URI to be for the form
 	//    cog://ipv4-addr/atomspace-name
 	//    cog://ipv4-addr:port/atomspace-name
 	//    cog://ipv4-addr/atomspace-name?stuff&more-stuff
-	// except that there aren't any vaid 'stuffs' at this time.
+	// The 'stuffs' are validated and applied by the client, before
+	// the connection is opened; here, they are just stripped off.
 
 	// Look for connection arguments
 	size_t parg = _uri.find('?');
@@ -98,7 +282,7 @@ void CogChannel<Client, Data>::open_connection(const std::string& uri)
 		// _stuff.push_back(args);
 	}
 
-	_host = uri.substr(URIX_LEN);
+	_host = _uri.substr(URIX_LEN);
 	size_t slash = _host.find_first_of(":/");
 	if (std::string::npos != slash)
 		_host = _host.substr(0, slash);
@@ -125,7 +309,7 @@ void CogChannel<Client, Data>::open_connection(const std::string& uri)
 	if (rc)
 		throw IOException(TRACE_INFO, "Unknown host %s: %s",
 			_host.c_str(), strerror(rc));
-	_servinfo = srvinfo;;
+	_servinfo = srvinfo;
 
 	// Try to open a connection, so that we find out immediately
 	// if a cogserver is actually there. If not, clean up and throw.
@@ -134,35 +318,214 @@ void CogChannel<Client, Data>::open_connection(const std::string& uri)
 		do_recv(true);
 	}
 	catch (const IOException& ex) {
-		freeaddrinfo((struct addrinfo *) _servinfo);
-		_servinfo = nullptr;
-		if (0 != s._sockfd)
+		free_servinfo();
+		s.release();
+		throw;
+	}
+	s.release();
+
+	// Make sure the buffer has some threads going.
+	for (size_t i=0; i<_shards.size(); i++)
+		_shards[i]->open(shard_threads(i, _shards.size()));
+	if (_reads) _reads->open(_nreaders);
+
+	// The decoders stay up until the channel is destroyed.
+	if (0 < _pipeline and _decoders.empty())
+		start_decoders();
+
+	// The janitor opens spare sockets whenever the queue backs up,
+	// so it runs even if nothing is ever closed for being idle.
+	_jan_stop = false;
+	_janitor = std::thread(&CogChannel::janitor, this);
+}
+
+// Open a spare socket once the queue holds this many messages for
+// each socket that is already open.
+#define GROW_BACKLOG 64
+
+/// Close sockets that haven't been used for a while. They will be
+/// re-opened by the thread that owns them, the next time it has
+/// something to send. Thus, the number of open sockets follows the
+/// load: when the queue backs up, more sockets are opened, and the
+/// worker threads that wake up to drain it use them; when things
+/// quiet down, they get closed.
+///
+/// Also send out batched writes that have been waiting too long.
+/// The worker that owns them might be busy elsewhere, or asleep.
+///
+/// Closing a socket joins its reader, and fails whatever is still
+/// pending on it, which calls back into the client. None of that is
+/// done while holding the registry lock. The sockets are picked out
+/// under it, and their `_busy` locks are taken; these keep a thread
+/// that is exiting from tearing down its socket until we're done.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::janitor(void)
+{
+	auto idle = std::chrono::seconds(_idle_secs);
+	auto delay = std::chrono::milliseconds(std::max<size_t>(_wdelay, 1));
+	auto nap = std::chrono::milliseconds(100);
+	if (0 < _wbatch) nap = std::min(nap, delay);
+
+	std::unique_lock<std::mutex> jlck(_jan_mtx);
+	while (not _jan_stop)
+	{
+		_jan_cv.wait_for(jlck, nap);
+		if (_jan_stop) break;
+
+		// The spares are only a head start; if they can't be had,
+		// the workers will find out for themselves.
+		try { grow(); }
+		catch (const std::exception& ex)
 		{
-			close(s._sockfd);
-			s._sockfd = 0;
+			fprintf(stderr, "Error: unable to open a spare socket: %s\n",
+				ex.what());
 		}
-		throw;
+
+		// While the queue is still backed up, the spares are about to
+		// be taken; don't close the ones that grow() just opened.
+		bool backlog = (size_t) _nsocks <= queue_size() / GROW_BACKLOG;
+
+		auto now = std::chrono::steady_clock::now();
+		std::vector<int> stale;
+		std::vector<std::pair<tlso*,
+			std::unique_lock<std::recursive_mutex>>> held;
+		{
+			std::lock_guard<std::mutex> rlck(_reg_mtx);
+
+			// Spares that no one took are idle, too.
+			if (0 < _idle_secs and not backlog)
+			{
+				auto it = std::remove_if(_spares.begin(), _spares.end(),
+					[&](const std::pair<int, std::chrono::steady_clock::time_point>& sp)
+					{
+						if (now - sp.second < idle) return false;
+						stale.push_back(sp.first);
+						return true;
+					});
+				_spares.erase(it, _spares.end());
+			}
+
+			for (tlso* so : _socks)
+			{
+				// If it's busy, then it's not idle.
+				std::unique_lock<std::recursive_mutex> busy(so->_busy,
+				                                            std::try_to_lock);
+				if (not busy.owns_lock()) continue;
+				if (0 == so->_sockfd) continue;
+				held.push_back({so, std::move(busy)});
+			}
+		}
+
+		for (int fd : stale)
+		{
+			close(fd);
+			_nsocks--;
+			_idle_closes++;
+		}
+
+		for (auto& sb : held)
+		{
+			tlso* so = sb.first;
+			if (0 < so->_wbuf.size() and delay <= now - so->_wfirst)
+			{
+				try { flush_wbuf(so); }
+				catch (...)
+				{
+					failed(std::current_exception(), nullptr, Data());
+					so->close_sock();
+					continue;
+				}
+			}
+
+			if (0 == _idle_secs or now - so->_last_use < idle) continue;
+
+			// A barrier is counting on this one.
+			if (_fencing) continue;
+			{
+				std::lock_guard<std::mutex> plck(so->_mtx);
+				if (0 < so->_pending.size()) continue;
+			}
+			so->close_sock();
+			_idle_closes++;
+		}
+		held.clear();
 	}
+}
 
-	if (0 != s._sockfd)
+/// The queue is backing up faster than the open sockets can drain
+/// it. Open more, up to one per worker thread, so that the workers
+/// that wake up to help don't have to wait for a connection first.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::grow(void)
+{
+	size_t nopen = _nsocks;
+	size_t want = std::min(queue_size() / GROW_BACKLOG, total_threads());
+	while (nopen < want)
 	{
-		close(s._sockfd);
-		s._sockfd = 0;
+		int sockfd = connect_sock();
+		{
+			std::lock_guard<std::mutex> rlck(_reg_mtx);
+			_spares.push_back({sockfd, std::chrono::steady_clock::now()});
+		}
+		_nsocks++;
+		_grown++;
+		nopen++;
 	}
+}
 
-	// Make sure the buffer has some threads going.
-	_msg_buffer.open(NTHREADS);
+/// A socket opened ahead of time by grow(), or -1 if there is none.
+template<typename Client, typename Data>
+int CogChannel<Client, Data>::take_spare(void)
+{
+	std::lock_guard<std::mutex> rlck(_reg_mtx);
+	if (_spares.empty()) return -1;
+	int sockfd = _spares.back().first;
+	_spares.pop_back();
+	return sockfd;
+}
+
+/// Called when a thread exits; its socket is going away.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::forget(tlso* so)
+{
+	std::lock_guard<std::mutex> rlck(_reg_mtx);
+	_socks.erase(so);
 }
 
+/// Give this thread a socket of its own: a spare, if there is one,
+/// else a fresh connection.
 template<typename Client, typename Data>
 int CogChannel<Client, Data>::open_sock()
 {
 	if (nullptr == _servinfo) return -1;
 
+	int sockfd = take_spare();
+	if (0 > sockfd)
+	{
+		sockfd = connect_sock();
+		_nsocks++;
+	}
+
+	s._sockfd = sockfd;
+	s._owner = this;
+	s._last_use = std::chrono::steady_clock::now();
+	{
+		std::lock_guard<std::mutex> rlck(_reg_mtx);
+		_socks.insert(&s);
+	}
+
+	return sockfd;
+}
+
+/// Connect to the cogserver, and get the s-expression shell. The
+/// socket is not counted, or owned by anyone, yet.
+template<typename Client, typename Data>
+int CogChannel<Client, Data>::connect_sock()
+{
 	// Try IPv4 and IPv6 until we successfully connect.
 	// Newer OS'es offer up IPv6 first, and cogserver is usually on IPv4
-	struct addrinfo *p;
 	int sockfd = -1;
+	struct addrinfo *p;
 	int norr = 0;
 	for (p = (struct addrinfo *) _servinfo; p != NULL; p = p->ai_next)
 	{
@@ -194,21 +557,36 @@ int CogChannel<Client, Data>::open_sock()
 		fprintf(stderr, "Error setting sockopt: %s", strerror(errno));
 #endif
 
+	if (0 < _rcvbuf)
+	{
+		rc = setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &_rcvbuf, sizeof(_rcvbuf));
+		if (0 > rc)
+			fprintf(stderr, "Error setting sockopt: %s", strerror(errno));
+	}
+
 	// Get the s-expression shell.
 	std::string eval = "sexpr\n";
 	rc = send(sockfd, eval.c_str(), eval.size(), 0);
 	if (0 > rc)
+	{
+		int norr = errno;
+		close(sockfd);
 		throw IOException(TRACE_INFO,
 			"Unable to talk to cogserver at host %s: %s",
-			_host.c_str(), strerror(errno));
+			_host.c_str(), strerror(norr));
+	}
 
-	// Throw away the cogserver prompt.
+	// Throw away the cogserver prompt. The calling thread has no
+	// socket of its own right now, so borrow its slot to read it.
 	s._sockfd = sockfd;
-	s._owner = this;
-	do_recv(true);
-
-	_nsocks++;
-
+	try { do_recv(true); }
+	catch (...)
+	{
+		s._sockfd = 0;
+		close(sockfd);
+		throw;
+	}
+	s._sockfd = 0;
 	return sockfd;
 }
 
@@ -221,11 +599,59 @@ bool CogChannel<Client, Data>::connected(void)
 template<typename Client, typename Data>
 void CogChannel<Client, Data>::close_connection(void)
 {
-	_msg_buffer.barrier();
-	_msg_buffer.close();
+	if (_janitor.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> jlck(_jan_mtx);
+			_jan_stop = true;
+		}
+		_jan_cv.notify_all();
+		_janitor.join();
+	}
 
-	freeaddrinfo((struct addrinfo *) _servinfo);
-	_servinfo = nullptr;
+	for (auto& sh : _shards) sh->barrier();
+	if (_reads) _reads->barrier();
+	drain_pipes();
+	for (auto& sh : _shards) sh->close();
+	if (_reads) _reads->close();
+
+	// The worker threads are gone, and their sockets with them. Any
+	// that are left belong to other threads (e.g. the caller's);
+	// close those too, and cut them loose, since the channel might
+	// be destroyed long before those threads exit.
+	//
+	// A thread that is using its socket holds `_busy`, and might be
+	// waiting on `_reg_mtx` (in open_sock()); so don't wait on it
+	// while holding the registry lock.
+	while (true)
+	{
+		std::unique_lock<std::mutex> rlck(_reg_mtx);
+		if (_socks.empty()) break;
+		tlso* so = *_socks.begin();
+		std::unique_lock<std::recursive_mutex> busy(so->_busy,
+		                                            std::try_to_lock);
+		if (not busy.owns_lock())
+		{
+			rlck.unlock();
+			std::this_thread::yield();
+			continue;
+		}
+		so->close_sock();
+		so->_owner = nullptr;
+		_socks.erase(so);
+	}
+
+	{
+		std::lock_guard<std::mutex> rlck(_reg_mtx);
+		for (const auto& sp : _spares)
+		{
+			close(sp.first);
+			_nsocks--;
+		}
+		_spares.clear();
+	}
+
+	free_servinfo();
 }
 
 /* ================================================================== */
@@ -233,21 +659,65 @@ void CogChannel<Client, Data>::close_connection(void)
 template<typename Client, typename Data>
 thread_local typename CogChannel<Client, Data>::tlso CogChannel<Client, Data>::s;
 
+template<typename Client, typename Data>
+thread_local bool CogChannel<Client, Data>::_in_reply = false;
+
+// Any batched writes go out first, in the same send().
 template<typename Client, typename Data>
 void CogChannel<Client, Data>::do_send(const std::string& str)
 {
+	// The socket is per-thread, not per-channel; a thread talking
+	// to some other channel has to let go of that one first.
+	if (s._owner and this != s._owner) s.release();
 	if (0 == s._sockfd) s._sockfd = open_sock();
+	if (0 < s._wbuf.size())
+	{
+		s._wbuf += str;
+		flush_wbuf(&s);
+		return;
+	}
 	int rc = send(s._sockfd, str.c_str(), str.size(), MSG_NOSIGNAL);
 	if (0 > rc)
 		throw IOException(TRACE_INFO, "Unable to talk to cogserver: %s",
 			strerror(errno));
 }
 
+// Hold on to a no-reply message, and send it later, together with
+// others. It goes out now if there are enough bytes waiting, or if
+// there's nothing else in the queue, or if this is the `last` one.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::send_batched(const std::string& str,
+                                            bool last)
+{
+	if (0 == s._sockfd) s._sockfd = open_sock();
+	if (0 == s._wbuf.size()) s._wfirst = std::chrono::steady_clock::now();
+	s._wbuf += str;
+	_wmsgs++;
+	if (last or _wbatch <= s._wbuf.size() or 0 == queue_size())
+		flush_wbuf(&s);
+}
+
+// The caller must hold the socket's `_busy` lock.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::flush_wbuf(tlso* so)
+{
+	if (0 == so->_wbuf.size()) return;
+	int rc = send(so->_sockfd, so->_wbuf.data(), so->_wbuf.size(),
+		MSG_NOSIGNAL);
+	so->_wbuf.clear();
+	_wsends++;
+	if (0 > rc)
+		throw IOException(TRACE_INFO, "Unable to talk to cogserver: %s",
+			strerror(errno));
+}
+
 // If the argument `garbage` is set to true, then assume that
 // the first read contains the CogServer prompt, which is maybe
 // colorized, and is, in any case, not newline teminated.
+// If `nreplies` is more than one, then keep reading until that
+// many newline-terminated replies have arrived.
 template<typename Client, typename Data>
-std::string CogChannel<Client, Data>::do_recv(bool garbage)
+std::string CogChannel<Client, Data>::do_recv(bool garbage, size_t nreplies)
 {
 	if (0 == s._sockfd)
 		throw IOException(TRACE_INFO, "No open socket!");
@@ -260,6 +730,7 @@ std::string CogChannel<Client, Data>::do_recv(bool garbage)
 	// read.
 	std::string rb;
 	bool first_time = true;
+	size_t nlines = 0;
 	while (true)
 	{
 		// Receive 8K bytes of message.
@@ -270,11 +741,9 @@ std::string CogChannel<Client, Data>::do_recv(bool garbage)
 		if (0 > len)
 			throw IOException(TRACE_INFO, "Unable to talk to cogserver: %s",
 				strerror(errno));
+		// The socket is closed by the caller, with release().
 		if (0 == len)
-		{
-			close(s._sockfd);
 			throw IOException(TRACE_INFO, "Cogserver unexpectedly closed connection");
-		}
 		buf[len] = 0;
 
 		// Ignore solitary synchronous idle chars.
@@ -298,23 +767,52 @@ std::string CogChannel<Client, Data>::do_recv(bool garbage)
 			if (0 == len) continue;
 		}
 
+		nlines += std::count(pbf, buf+len, '\n');
+		bool done = ('\n' == buf[len-1]) and (nreplies <= nlines);
+
 		// If we have a short read, assume we are done.
 		// Normal short reads are either newline-terminated,
 		// or are reads of the cogserver prompt, which are
 		// blank-space terminated.
-		if (first_time and (('\n' == buf[len-1]) or garbage))
+		if (first_time and (done or garbage))
 			return pbf;
 
 		first_time = false;
 		rb += pbf;
 
 		// newline-terminated strings mean we are done.
-		if ('\n' == buf[len-1])
+		if (done)
 			return rb;
 	}
 	return rb;
 }
 
+// Lock-step version of the streamed receive.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::recv_stream(const Msg& msg)
+{
+	if (0 == s._sockfd)
+		throw IOException(TRACE_INFO, "No open socket!");
+
+	ListStream lst;
+	while (true)
+	{
+		char buf[8192];
+		int len = recv(s._sockfd, buf, sizeof(buf), 0);
+		if (0 > len and EINTR == errno) continue;
+		if (0 > len)
+			throw IOException(TRACE_INFO, "Unable to talk to cogserver: %s",
+				strerror(errno));
+		// The socket is closed by the caller, with release().
+		if (0 == len)
+			throw IOException(TRACE_INFO, "Cogserver unexpectedly closed connection");
+
+		// Client is called unlocked.
+		size_t used = 0;
+		if (stream_reply(lst, msg, buf, len, used)) return;
+	}
+}
+
 /* ================================================================== */
 
 template<typename Client, typename Data>
@@ -323,8 +821,20 @@ void CogChannel<Client, Data>::synchro(Client* client,
                                        Data& data,
                   void (Client::*handler)(const std::string&, Data&))
 {
-	do_send(msg);
-	std::string reply = do_recv();
+	std::unique_lock<std::recursive_mutex> busy(s._busy);
+	s._last_use = std::chrono::steady_clock::now();
+	std::string reply;
+	try
+	{
+		do_send(msg);
+		reply = do_recv();
+	}
+	catch (...)
+	{
+		s.release();
+		throw;
+	}
+	busy.unlock();
 
 	// Client is called unlocked.
 	(client->*handler)(reply, data);
@@ -332,107 +842,596 @@ void CogChannel<Client, Data>::synchro(Client* client,
 
 /* ================================================================== */
 
-// Place the message into queue
+// Place the message into queue.
+// Messages are de-duplicated; if the caller needs to know that
+// its own message, in particular, was handled (e.g. because the
+// data holds something to wait on), then ask for a `unique` one.
 template<typename Client, typename Data>
 void CogChannel<Client, Data>::enqueue(Client* client,
                                        const std::string& msg,
                                        Data& data,
-                  void (Client::*handler)(const std::string&, const Data&))
+                  void (Client::*handler)(const std::string&, const Data&),
+                                       size_t nreplies, size_t affinity,
+                                       bool unique)
+{
+	Msg block{client, handler, false, msg, data, nreplies};
+	if (unique) block.sequence = ++Msg::_sequence_counter;
+	insert(block, affinity);
+}
+
+// Place message into queue. The reply is expected to be a list,
+// possibly a very long one; the callback will be called several
+// times, each time with a list of some of the elements, as they
+// arrive.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::enqueue_stream(Client* client,
+                                              const std::string& msg,
+                                              Data& data,
+                  void (Client::*handler)(const std::string&, const Data&),
+                                              bool unique)
+{
+	Msg block{client, handler, false, msg, data};
+	block.stream = true;
+	if (unique) block.sequence = ++Msg::_sequence_counter;
+	insert(block, 0);
+}
+
+// The same, for fetches: with a read lane (see set_readers()), these
+// go there, instead of waiting behind the writes. Everything else
+// stays in the shards, even if it expects a reply.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::enqueue_fetch(Client* client,
+                                             const std::string& msg,
+                                             Data& data,
+                  void (Client::*handler)(const std::string&, const Data&),
+                                             size_t nreplies, size_t affinity,
+                                             bool unique)
+{
+	Msg block{client, handler, false, msg, data, nreplies};
+	block.fetch = true;
+	if (unique) block.sequence = ++Msg::_sequence_counter;
+	insert(block, affinity);
+}
+
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::enqueue_fetch_stream(Client* client,
+                                                    const std::string& msg,
+                                                    Data& data,
+                  void (Client::*handler)(const std::string&, const Data&),
+                                                    bool unique)
 {
 	Msg block{client, handler, false, msg, data};
-	_msg_buffer.insert(block);
+	block.stream = true;
+	block.fetch = true;
+	if (unique) block.sequence = ++Msg::_sequence_counter;
+	insert(block, 0);
 }
 
 // Place message into queue, no response expected from server
 template<typename Client, typename Data>
-void CogChannel<Client, Data>::enqueue_noreply(const std::string& msg)
+void CogChannel<Client, Data>::enqueue_noreply(const std::string& msg,
+                                               size_t affinity)
 {
 	Data dummy = Data();
 	Msg block{nullptr, nullptr, true, msg, dummy};
-	_msg_buffer.insert(block);
+	insert(block, affinity);
 }
 
-// Run message from queue.
+// Run message from queue. This is the worker thread; exceptions
+// can't go any further than this. Record them, for the next barrier.
 template<typename Client, typename Data>
 void CogChannel<Client, Data>::reply_handler(const Msg& msg)
 {
-	do_send(msg.str_to_send);
+	s._worker = true;
+	try { handle(msg); }
+	catch (...)
+	{
+		failed(std::current_exception(), msg.client, msg.data);
+
+		// Callback errors are caught before they get here; this is
+		// an I/O error. Who knows what state the socket is in; get
+		// a fresh one, next time around.
+		s.release();
+	}
+}
+
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::handle(const Msg& msg)
+{
+	std::lock_guard<std::recursive_mutex> busy(s._busy);
+
+	// Only the sockets that barrier() counted send it. It doesn't
+	// count as using the socket; else the barriers alone would keep
+	// every socket open forever.
+	bool fence = (msg.noreply and
+		0 == msg.str_to_send.compare(0, 12, "(cog-barrier"));
+	if (fence and not s._fence.exchange(false)) return;
+	if (not fence) s._last_use = std::chrono::steady_clock::now();
 
 	// No-reply commands: just send, don't wait for response
-	if (msg.noreply) return;
+	if (msg.noreply)
+	{
+		// The server hung up on the last socket; get a new one.
+		if (s._dead) s.close_sock();
+		if (0 == _wbatch)
+			do_send(msg.str_to_send);
+		else
+			// A barrier has to go out now; nothing comes after it.
+			send_batched(msg.str_to_send, fence);
+		return;
+	}
 
-	std::string reply = do_recv();
+	// Pipelined mode: queue up the message, so that the reader
+	// thread can match it to the reply, and then move on, without
+	// waiting. The server handles the commands on any given socket
+	// in order, so replies come back in the same order.
+	if (0 < _pipeline)
+	{
+		// The server hung up on the last socket; get a new one.
+		if (s._dead) s.close_sock();
+		if (0 == s._sockfd) s._sockfd = open_sock();
+		if (not s._reader.joinable())
+			s._reader = std::thread(&CogChannel::pipe_reader, this, &s);
+
+		{
+			std::unique_lock<std::mutex> lck(s._mtx);
+			s._cv.wait(lck, [&]{
+				return s._dead or s._pending.size() < _pipeline; });
+
+			// No reply would ever be read. Fail it, and start over
+			// with a fresh socket, next time.
+			if (s._dead)
+				throw IOException(TRACE_INFO,
+					"Cogserver closed connection");
+			s._pending.push_back(msg);
+			_inflight++;
+		}
+
+		try { do_send(msg.str_to_send); }
+		catch (...)
+		{
+			// If the reader gave up on the socket, then it has
+			// already failed this message, along with the rest.
+			std::lock_guard<std::mutex> lck(s._mtx);
+			if (s._dead) return;
+			s._pending.pop_back();
+			landed();
+			throw;
+		}
+		return;
+	}
+
+	do_send(msg.str_to_send);
+	if (msg.stream)
+	{
+		recv_stream(msg);
+		return;
+	}
+	std::string reply = do_recv(false, msg.nreplies);
 
 	// Client is called unlocked.
-	// XXX FIXME. The callback can throw an exception;
-	// e.g. opencog::Sexpr::decode_atom for an Atom type
-	// defined in a module that isn't loaded. Since we are
-	// running in a distinct async thread, I don't know how
-	// to pass this exception back to the caller. Well I do
-	// know how but am too lazy to implement. So instead,
-	// this will just core dump. Boo hoo. An alternative
-	// would be to write to a log file, but that's bad design.
-	// So we will core dump, for now.
-	// Same comment for the synchro callback above.
-	(msg.client->*msg.callback)(reply, msg.data);
+	invoke(msg.client, msg.callback, reply, msg.data);
+}
+
+/// Call the client. If it throws, keep the exception for later.
+/// (The synchro() callback is not called through here; it runs in
+/// the caller's thread, and so its exceptions go right back to it.)
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::invoke(Client* client,
+                  void (Client::*callback)(const std::string&, const Data&),
+                                      const std::string& reply,
+                                      const Data& data)
+{
+	bool outer = _in_reply;
+	_in_reply = true;
+	try { (client->*callback)(reply, data); }
+	catch (...)
+	{
+		failed(std::current_exception(), client, data);
+	}
+	_in_reply = outer;
+}
+
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::failed(const std::exception_ptr& ep,
+                                      Client* client, const Data& data)
+{
+	_nerrors++;
+	if (client and _on_error and (client->*_on_error)(ep, data))
+		return;
+
+	std::lock_guard<std::mutex> lck(_err_mtx);
+	if (nullptr == _error) _error = ep;
+}
+
+// Streamed replies: hand the list elements to the callback as they
+// arrive, a window at a time, instead of waiting for the whole list.
+// Sets `used` to the number of bytes used up. Returns true if the
+// reply is complete; `lst` is then ready for the next one.
+template<typename Client, typename Data>
+bool CogChannel<Client, Data>::stream_reply(ListStream& lst,
+                                            const Msg& msg,
+                                            const char* buf, size_t len,
+                                            size_t& used)
+{
+	used = lst.feed(buf, len);
+	while (_window <= lst.ready())
+		dispatch(msg, lst.take());
+
+	if (not lst.complete()) return false;
+
+	dispatch(msg, lst.take());
+	lst.reset();
+	return true;
+}
+
+/// Bytes read off of a pipelined socket, that are not yet handed out.
+template<typename Client, typename Data>
+struct CogChannel<Client, Data>::Pipe
+{
+	std::string rb;      // Bytes that are not yet a whole reply.
+	std::string reply;   // The replies so far, to a multi-reply message.
+	size_t got = 0;      // How many replies are in `reply`.
+	ListStream lst;      // The streamed reply, if any.
+};
+
+// Pipelined mode: read replies off of the socket, and hand them
+// to the callbacks of the pending messages, in the order that the
+// messages were sent.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::pipe_reader(tlso* so)
+{
+	Pipe pipe;
+	while (true)
+	{
+		char buf[8192];
+		int len = recv(so->_sockfd, buf, sizeof(buf), 0);
+		if (0 > len and EINTR == errno) continue;
+
+		// Socket closed. This is normal during shutdown, when there
+		// is nothing pending. Otherwise, the server went away, and
+		// no replies will ever arrive; don't let barriers hang.
+		if (0 >= len)
+		{
+			drop_pending(so);
+			return;
+		}
+		pipe_input(so, pipe, buf, len);
+	}
+}
+
+// Replies are newline-terminated; a single recv() may hold several
+// replies, or just a fragment of one. A message that asked for
+// several replies gets them all at once.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::pipe_input(tlso* so, Pipe& pipe,
+                                          const char* buf, size_t len)
+{
+	std::string& rb = pipe.rb;
+	std::string& reply = pipe.reply;
+
+	// Ignore synchronous idle chars. The CogServer sends these
+	// when it is congested and is looking for half-open sockets.
+	rb.reserve(rb.size() + len);
+	std::remove_copy(buf, buf+len, std::back_inserter(rb), 0x16);
+
+	// Hand out as many replies as there are.
+	size_t start = 0;
+	while (start < rb.size())
+	{
+		// Only this thread pops the pending list; other threads
+		// only push onto the back. So the front stays put.
+		const Msg* front = nullptr;
+		{
+			std::lock_guard<std::mutex> lck(so->_mtx);
+			if (0 < so->_pending.size()) front = &so->_pending.front();
+		}
+
+		if (front and front->stream)
+		{
+			// Client is called unlocked.
+			size_t used = 0;
+			bool done = stream_reply(pipe.lst, *front,
+				rb.data() + start, rb.size() - start, used);
+			start += used;
+			if (not done) break;
+		}
+		else
+		{
+			size_t nl = rb.find('\n', start);
+			if (rb.npos == nl) break;
+			reply += rb.substr(start, nl+1-start);
+			start = nl+1;
+			pipe.got++;
+
+			if (nullptr == front)
+			{
+				fprintf(stderr, "Error: unexpected reply from cogserver: %s",
+					reply.c_str());
+				reply.clear();
+				pipe.got = 0;
+				continue;
+			}
+			if (pipe.got < front->nreplies) continue;
+
+			// Client is called unlocked.
+			dispatch(*front, reply);
+			reply.clear();
+			pipe.got = 0;
+		}
+
+		{
+			std::lock_guard<std::mutex> lck(so->_mtx);
+			so->_pending.pop_front();
+		}
+		so->_cv.notify_all();
+		landed();
+	}
+	rb.erase(0, start);
+}
+
+/// No more replies will arrive on this socket. The messages that are
+/// waiting for them have failed; record that, so that the next barrier
+/// (and anyone waiting on just those messages) finds out.
+/// The socket is marked dead; the thread that owns it opens a new one
+/// the next time around, and fails anything it tries to send before
+/// that.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::drop_pending(tlso* so)
+{
+	std::deque<Msg> dropped;
+	{
+		std::lock_guard<std::mutex> lck(so->_mtx);
+		dropped.swap(so->_pending);
+		so->_dead = true;
+	}
+	so->_cv.notify_all();
+	if (0 == dropped.size()) return;
+
+	std::exception_ptr ep = std::make_exception_ptr(IOException(TRACE_INFO,
+		"Cogserver closed connection; dropped %zu pending replies",
+		dropped.size()));
+	for (const Msg& msg : dropped)
+	{
+		failed(ep, msg.client, msg.data);
+		landed();
+	}
+}
+
+/// Hand a reply to the client. In pipelined mode, the decoder threads
+/// do it, so that a reader never blocks in a callback; otherwise, it's
+/// done right here. The decoders count as being in flight, so that
+/// barriers wait for them.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::dispatch(const Msg& msg,
+                                        const std::string& reply)
+{
+	if (0 == _pipeline)
+	{
+		invoke(msg.client, msg.callback, reply, msg.data);
+		return;
+	}
+	_inflight++;
+	_decode_q.push({msg.client, msg.callback, msg.data, reply});
+}
+
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::decoder(void)
+{
+	while (true)
+	{
+		Decode dec;
+		try { _decode_q.pop(dec); }
+		catch (typename concurrent_queue<Decode>::Canceled& e)
+		{
+			return;
+		}
+
+		invoke(dec.client, dec.callback, dec.reply, dec.data);
+		landed();
+	}
+}
+
+/* ================================================================== */
+
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::start_decoders(void)
+{
+	size_t ndec = std::max((size_t) 1, _ndecode);
+	for (size_t i=0; i<ndec; i++)
+		_decoders.push_back(std::thread(&CogChannel::decoder, this));
+}
+
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::stop_decoders(void)
+{
+	_decode_q.cancel();
+	for (std::thread& t : _decoders) t.join();
+	_decoders.clear();
+	_decode_q.cancel_reset();
+}
+
+/// Wait until all replies outstanding on pipelined sockets have
+/// been received and handled.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::drain_pipes()
+{
+	std::unique_lock<std::mutex> lck(_inflight_mtx);
+	_inflight_cv.wait(lck, [&]{ return 0 == _inflight; });
+}
+
+/// One less reply in flight. The lock is taken before waking the
+/// waiters, so that drain_pipes() can't miss the last one.
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::landed()
+{
+	if (0 < --_inflight) return;
+	std::lock_guard<std::mutex> lck(_inflight_mtx);
+	_inflight_cv.notify_all();
+}
+
+/// Mark the worker sockets that are open now; these, and only these,
+/// send the next barrier message. The janitor won't close them until
+/// unfence(). Returns how many there are.
+template<typename Client, typename Data>
+size_t CogChannel<Client, Data>::fence_open(void)
+{
+	std::lock_guard<std::mutex> rlck(_reg_mtx);
+	_fencing = true;
+	size_t nopen = 0;
+	for (tlso* so : _socks)
+	{
+		if (not so->_worker or 0 == so->_sockfd) continue;
+		so->_fence = true;
+		nopen++;
+	}
+	return nopen;
+}
+
+template<typename Client, typename Data>
+void CogChannel<Client, Data>::unfence(void)
+{
+	std::lock_guard<std::mutex> rlck(_reg_mtx);
+	_fencing = false;
 }
 
 template<typename Client, typename Data>
 void CogChannel<Client, Data>::barrier()
 {
-	// Generate a unique barrier ID
-	static thread_local std::minstd_rand rng(std::random_device{}());
-	uint64_t rnd = (uint64_t(rng()) << 32) | rng();
+	// The socket marks are for one barrier at a time.
+	std::lock_guard<std::mutex> blck(_bar_mtx);
+	while (true)
+	{
+		size_t requeued = _requeued.load();
 
-	// Build the barrier message. Each worker thread will send this,
-	// opening its socket if needed. Server completes when all N arrive.
-	char msg[64];
-	snprintf(msg, sizeof(msg), "(cog-barrier %u \"%016lx\")\n", NTHREADS, rnd);
+		// Send everything that came before. This opens whatever
+		// sockets that takes; a socket that is still closed after
+		// this has nothing in flight, and need not be fenced.
+		for (auto& sh : _shards) sh->barrier();
+		if (_reads) _reads->barrier();
 
-	Data dummy = Data();
-	Msg block{nullptr, nullptr, true, msg, dummy};
-	_msg_buffer.barrier(block);
+		// Generate a unique barrier ID
+		static thread_local std::minstd_rand rng(std::random_device{}());
+		uint64_t rnd = (uint64_t(rng()) << 32) | rng();
+
+		// Build the barrier message. Each worker thread with an open
+		// socket will send this. Server completes when all N arrive.
+		// All of the shards send the same one, so that the fence holds
+		// across all of the sockets. The read lane, if any, takes part,
+		// too.
+		size_t nopen = fence_open();
+		if (0 < nopen)
+		{
+			char msg[64];
+			snprintf(msg, sizeof(msg), "(cog-barrier %zu \"%016lx\")\n",
+				nopen, rnd);
+
+			Data dummy = Data();
+			Msg block{nullptr, nullptr, true, msg, dummy};
+			for (auto& sh : _shards) sh->barrier(block);
+			if (_reads) _reads->barrier(block);
+		}
+		unfence();
+
+		// In pipelined mode, the barrier message went out after all
+		// earlier requests, but their replies may still be in flight.
+		// Wait for them.
+		if (0 < _pipeline) drain_pipes();
+
+		// The reply callbacks might have queued up more work (e.g.
+		// decode_atom_list() does), perhaps into a shard that was
+		// already fenced. If so, go again, to fence that too. Work
+		// queued by other threads is theirs to wait on.
+		if (requeued == _requeued.load()) break;
+	}
+
+	// Everything before the barrier is done. If any of it failed,
+	// now is the time to say so.
+	std::exception_ptr ep;
+	{
+		std::lock_guard<std::mutex> lck(_err_mtx);
+		std::swap(ep, _error);
+	}
+	if (ep) std::rethrow_exception(ep);
 }
 
 template<typename Client, typename Data>
 void CogChannel<Client, Data>::flush()
 {
-	_msg_buffer.flush();
+	for (auto& sh : _shards) sh->flush();
+	if (_reads) _reads->flush();
 }
 
 template<typename Client, typename Data>
 void CogChannel<Client, Data>::clear_stats()
 {
-	_msg_buffer.clear_stats();
+	for (auto& sh : _shards) sh->clear_stats();
+	if (_reads) _reads->clear_stats();
+	_nerrors = 0;
+	_wsends = 0;
+	_wmsgs = 0;
 }
 
 template<typename Client, typename Data>
 std::string CogChannel<Client, Data>::print_stats()
 {
+	// Add up the stats from all of the shards.
+	size_t busy = 0, items = 0, dups = 0, flushes = 0, drains = 0;
+	size_t drain_msec = 0, concurrent = 0;
+	bool in_drain = false, stalled = false;
+	for (const auto& sh : _shards)
+	{
+		busy += sh->get_busy_writers();
+		items += sh->_item_count;
+		dups += sh->_duplicate_count;
+		flushes += sh->_flush_count;
+		drains += sh->_drain_count;
+		drain_msec += sh->_drain_msec;
+		concurrent += sh->_drain_concurrent;
+		in_drain = in_drain or sh->_in_drain;
+		stalled = stalled or sh->stalling();
+	}
+
 	std::string rs =
 		"Open socks: " + std::to_string(_nsocks.load()) +
+		"/" + std::to_string(total_threads()) +
+		"  Idle closes: " + std::to_string(_idle_closes.load()) +
+		"  Grown: " + std::to_string(_grown.load()) +
 		"  Connected to: " + _uri +
 		"\n" +
-		"Queue size: " + std::to_string(_msg_buffer.get_size()) +
-		"  Busy: " + std::to_string(_msg_buffer.get_busy_writers()) +
-		"/" + std::to_string(NTHREADS) +
-		(_msg_buffer._in_drain ? " Draining now" : "") +
+		"Queue size: " + std::to_string(queue_size()) +
+		"  Busy: " + std::to_string(busy) +
+		"/" + std::to_string(_nthreads) +
+		"  Shards: " + std::to_string(_shards.size()) +
+		(_affinity ? " (by Atom)" : "") +
+		(_reads ? "  Read lane: " + std::to_string(_reads->get_size()) +
+			" queued, " + std::to_string(_nreaders) + " threads" : "") +
+		(in_drain ? " Draining now" : "") +
+		"\n" +
+		"Messages: " + std::to_string(items) +
+		"  Duplicates: " + std::to_string(dups) +
+		"\n" +
+		"Flush count: " + std::to_string(flushes) +
+		"  Drains: " + std::to_string(drains) +
 		"\n" +
-		"Messages: " + std::to_string(_msg_buffer._item_count) +
-		"  Duplicates: " + std::to_string(_msg_buffer._duplicate_count) +
+		"Drain time (msec): " + std::to_string(drain_msec) +
+		"  Slowest (msec): " + std::to_string(drains) +
+		"  Concurrent: " + std::to_string(concurrent) +
 		"\n" +
-		"Flush count: " + std::to_string(_msg_buffer._flush_count) +
-		"  Drains: " + std::to_string(_msg_buffer._drain_count) +
+		"Pipeline depth: " + std::to_string(_pipeline) +
+		"  In flight: " + std::to_string(_inflight.load()) +
+		"  Chunk size: " + std::to_string(_window) +
+		"  Errors: " + std::to_string(_nerrors.load()) +
 		"\n" +
-		"Drain time (msec): " + std::to_string(_msg_buffer._drain_msec) +
-		"  Slowest (msec): " + std::to_string(_msg_buffer._drain_count) +
-		"  Concurrent: " + std::to_string(_msg_buffer._drain_concurrent) +
+		"Decoders: " + std::to_string(_decoders.size()) +
+		"  Batched writes: " + std::to_string(_wmsgs.load()) +
+		" in " + std::to_string(_wsends.load()) + " sends" +
 		"\n" +
 		"Low/High watermarks: " +
-		std::to_string(_msg_buffer.get_low_watermark()) +
+		std::to_string(_shards[0]->get_low_watermark()) +
 		"/" +
-		std::to_string(_msg_buffer.get_high_watermark()) +
-		"  Stalled: " + (_msg_buffer.stalling() ? "true" : "false") +
+		std::to_string(_shards[0]->get_high_watermark()) +
+		"  Stalled: " + (stalled ? "true" : "false") +
 		"\n";
 
 	return rs;
@@ -31,12 +31,22 @@
 #define _OPENCOG_COG_CHANNEL_H
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
+#include <sys/socket.h> /* for shutdown() */
 #include <unistd.h> /* for close() */
 
 #include <opencog/util/async_buffer.h>
+#include <opencog/util/concurrent_queue.h>
 
 namespace opencog
 {
@@ -44,6 +54,8 @@ namespace opencog
  *  @{
  */
 
+class ListStream;
+
 template<typename Client, typename Data>
 class CogChannel
 {
@@ -52,25 +64,27 @@ class CogChannel
 		std::string _host;
 		std::string _port;
 		void* _servinfo;
+		void free_servinfo(void);
 		std::atomic_int _nsocks{0};
 
-		// Socket API.
-		static thread_local struct tlso {
-			int _sockfd;
-			CogChannel* _owner;
-			tlso() : _sockfd(0), _owner(nullptr) {}
-			~tlso() { if (_sockfd) { close(_sockfd); if (_owner) _owner->_nsocks--; }}
-		} s;
-		int open_sock();
-		void do_send(const std::string&);
-		std::string do_recv(bool=false);
+		// Tuning knobs, usually set from the URI. Zero means
+		// "use the default".
+		size_t _nthreads;  // Number of worker threads and sockets
+		size_t _hiwat;     // Queue high watermark
+		size_t _lowat;     // Queue low watermark
+		int _rcvbuf;       // Socket receive buffer size, SO_RCVBUF
 
 		struct Msg
 		{
 			Client* client;
 			void (Client::*callback)(const std::string&, const Data&);
 			size_t sequence;
+			size_t order;  // Place in line, in first-in, first-out mode
+			size_t hash;   // Of str_to_send; cheaper to compare
 			bool noreply;  // If true, skip do_recv()
+			size_t nreplies; // Number of newline-terminated replies
+			bool stream;   // Reply is a list, handed out piecemeal
+			bool fetch;    // Goes in the read lane, if there is one
 
 			std::string str_to_send;
 			Data data;
@@ -79,7 +93,10 @@ class CogChannel
 			static std::atomic<size_t> _sequence_counter;
 
 			// Default constructor required by concurrent_set
-			Msg() : client(nullptr), callback(nullptr), sequence(0), noreply(true) {}
+			Msg() : client(nullptr), callback(nullptr), sequence(0),
+			        order(0), hash(0),
+			        noreply(true), nreplies(1), stream(false),
+			        fetch(false) {}
 
 			// The mesage buffer is a de-duplicating buffer: identical
 			// messages are added only once. This makes sense for almost
@@ -87,10 +104,16 @@ class CogChannel
 			// store operation is idempotent. The one exception is the
 			// cog-update-value! message: these are never idempotent;
 			// we use a sequence number to make sure each is unique.
+			// A message may hold several commands, one per line; if so,
+			// then `nrep` says how many replies to wait for. These are
+			// handed to the callback all at once, as one string.
 			Msg(Client* c, void (Client::*cb)(const std::string&, const Data&),
-			    bool nr, const std::string& str, const Data& d)
-				: client(c), callback(cb), noreply(nr),
-				  str_to_send(str), data(d)
+			    bool nr, const std::string& str, const Data& d,
+			    size_t nrep = 1)
+				: client(c), callback(cb), order(0),
+				  hash(std::hash<std::string>{}(str)),
+				  noreply(nr), nreplies(nrep),
+				  stream(false), fetch(false), str_to_send(str), data(d)
 			{
 				// Non-idempotent messages get unique sequence numbers.
 				if (str.compare(0, 19, "(cog-update-value!") == 0)
@@ -108,16 +131,230 @@ class CogChannel
 			// (idempotent messages deduplicate). Otherwise compare by
 			// sequence number (non-idempotent messages stay unique).
 			// Place `cog-update-value!` messages early in the set.
+			// The strings can be large; compare the hashes first, and
+			// look at the strings only when the hashes collide.
+			// In affinity mode, every message has a place in line, and
+			// the queue is first-in, first-out.
 			bool operator<(const Msg& other) const
 			{
+				if (0 < order or 0 < other.order)
+					return order < other.order;
 				if (sequence == 0 and other.sequence == 0)
+				{
+					if (hash != other.hash) return hash < other.hash;
 					return str_to_send < other.str_to_send;
+				}
 				return sequence > other.sequence;
 			}
 		};
 
-		async_buffer<CogChannel, Msg> _msg_buffer;
+		// Bytes read off of a pipelined socket; see pipe_reader().
+		struct Pipe;
+
+		// Socket API.
+		static thread_local struct tlso {
+			int _sockfd;
+			CogChannel* _owner;
+
+			// Pipelined mode: replies are read by a distinct thread,
+			// and are matched up, in order, with the messages that
+			// were sent on this socket.
+			std::thread _reader;
+			std::mutex _mtx;
+			std::condition_variable _cv;
+			std::deque<Msg> _pending;
+			bool _dead;  // The server closed it; see drop_pending().
+
+			// Held while the socket is in use, so that the janitor
+			// doesn't close it out from under us. Every close takes
+			// it, including those made while it's already held.
+			std::recursive_mutex _busy;
+			std::chrono::steady_clock::time_point _last_use;
+
+			// Set for the sockets of the worker threads; only these
+			// take part in a barrier, and only if they were open
+			// when it started. See barrier().
+			bool _worker;
+			std::atomic<bool> _fence{false};
+
+			// No-reply messages waiting to be sent all at once,
+			// and when the oldest of them was put here.
+			std::string _wbuf;
+			std::chrono::steady_clock::time_point _wfirst;
+
+			tlso() : _sockfd(0), _owner(nullptr), _dead(false),
+			         _worker(false) {}
+			~tlso() { release(); }
+
+			// Close the socket, and cut loose from the channel, so
+			// that a thread that outlives the channel (e.g. the one
+			// that opened it) doesn't point back at it.
+			void release() {
+				close_sock();
+				if (_owner) _owner->forget(this);
+				_owner = nullptr;
+			}
+
+			// Close the socket, but stay registered with the channel;
+			// the owning thread will open a new one when it needs it.
+			void close_sock() {
+				std::lock_guard<std::recursive_mutex> busy(_busy);
+
+				// Last chance for any batched-up writes.
+				if (_sockfd and 0 < _wbuf.size())
+					send(_sockfd, _wbuf.data(), _wbuf.size(), MSG_NOSIGNAL);
+				_wbuf.clear();
+
+				// Shutting down the socket unblocks the reader.
+				if (_reader.joinable())
+				{
+					shutdown(_sockfd, SHUT_RDWR);
+					_reader.join();
+				}
+				if (_sockfd)
+				{
+					close(_sockfd);
+					_sockfd = 0;
+					if (_owner) _owner->_nsocks--;
+				}
+				std::lock_guard<std::mutex> lck(_mtx);
+				_dead = false;
+			}
+		} s;
+		int open_sock();
+		int connect_sock();
+		void do_send(const std::string&);
+		void send_batched(const std::string&, bool);
+		void flush_wbuf(tlso*);
+		std::string do_recv(bool=false, size_t=1);
+		void recv_stream(const Msg&);
+		bool stream_reply(ListStream&, const Msg&,
+		                  const char*, size_t, size_t&);
+		void pipe_reader(tlso*);
+		void pipe_input(tlso*, Pipe&, const char*, size_t);
+		void drop_pending(tlso*);
+
+		// Pipelined mode: the replies are handed over to a pool of
+		// decoder threads, so that the readers get right back to
+		// reading. The readers never call the client themselves: a
+		// callback that queues up more messages may block, until the
+		// replies to earlier ones are read. There is always at least
+		// one decoder.
+		size_t _ndecode;
+		void start_decoders(void);
+		void stop_decoders(void);
+
+		struct Decode
+		{
+			Client* client;
+			void (Client::*callback)(const std::string&, const Data&);
+			Data data;
+			std::string reply;
+		};
+		concurrent_queue<Decode> _decode_q;
+		std::vector<std::thread> _decoders;
+		void decoder(void);
+		void dispatch(const Msg&, const std::string&);
+
+		// Write batching. No-reply messages are gathered up, per
+		// socket, and sent together, once there are `_wbatch` bytes
+		// of them, or they are `_wdelay` msecs old, or there's nothing
+		// else left to do. Zero bytes means send each one right away.
+		size_t _wbatch;
+		size_t _wdelay;
+		std::atomic<size_t> _wsends{0};
+		std::atomic<size_t> _wmsgs{0};
+
+		// Elastic pool. Sockets are opened when a thread first has
+		// something to send, and are closed again after they've been
+		// idle for a while. Zero means keep them open forever. When
+		// the queue backs up, spare sockets are opened ahead of time,
+		// for the workers that wake up to help out; this is done
+		// whether or not idle sockets are closed.
+		size_t _idle_secs;
+		std::mutex _reg_mtx;
+		std::set<tlso*> _socks;
+		std::vector<std::pair<int, std::chrono::steady_clock::time_point>> _spares;
+		std::thread _janitor;
+		std::mutex _jan_mtx;
+		std::condition_variable _jan_cv;
+		bool _jan_stop;
+		std::atomic<size_t> _idle_closes{0};
+		std::atomic<size_t> _grown{0};
+		void janitor(void);
+		void grow(void);
+		int take_spare(void);
+		void forget(tlso*);
+
+		// Barriers go only to the sockets that are open; the janitor
+		// leaves those alone until the barrier is done.
+		std::mutex _bar_mtx;
+		bool _fencing;
+		size_t fence_open(void);
+		void unfence(void);
+
+		// The message queue can be split into several shards, each
+		// with its own lock and its own worker threads, so that many
+		// producer threads don't all contend for one lock. Identical
+		// messages have the same hash, and so land in the same shard,
+		// where they are de-duplicated as before.
+		typedef async_buffer<CogChannel, Msg> MsgBuffer;
+		std::vector<std::unique_ptr<MsgBuffer>> _shards;
+		MsgBuffer& shard(const Msg& m)
+			{ return *_shards[m.hash % _shards.size()]; }
+		void insert(Msg&, size_t);
+		size_t queue_size(void);
+		int shard_threads(size_t, size_t);
+		void apply_watermarks(MsgBuffer&);
+
+		// The read lane. Fetches can be given their own worker
+		// threads, and so their own sockets, so that they don't wait
+		// in line behind a big pile of writes. Everything else that
+		// expects a reply (removes, bulk loads, proxy commands) stays
+		// in the shards. Zero means reads and writes share the shards.
+		size_t _nreaders;
+		std::unique_ptr<MsgBuffer> _reads;
+		size_t total_threads(void) const { return _nthreads + _nreaders; }
+
+		// Affinity mode: one thread per shard, and messages about
+		// the same Atom always go to the same shard, in order.
+		bool _affinity;
 		void reply_handler(const Msg&);
+		void handle(const Msg&);
+
+		// The reply callbacks can throw, e.g. when decoding an Atom
+		// of a type that isn't loaded here. They run in the worker,
+		// reader and decoder threads, where there is no one to catch
+		// the exception. So the first one is kept, and is rethrown
+		// by the next barrier(). The client is told about each one
+		// first; if it passes it along, e.g. to a future, it returns
+		// true, and the error is not kept for the barrier.
+		std::mutex _err_mtx;
+		std::exception_ptr _error;
+		std::atomic<size_t> _nerrors{0};
+		bool (Client::*_on_error)(const std::exception_ptr&, const Data&);
+		void invoke(Client*,
+		            void (Client::*)(const std::string&, const Data&),
+		            const std::string&, const Data&);
+		void failed(const std::exception_ptr&, Client*, const Data&);
+
+		// Maximum number of replies that may be outstanding on
+		// each socket. Zero means lock-step send-then-receive.
+		size_t _pipeline;
+		std::atomic<size_t> _inflight{0};
+		std::mutex _inflight_mtx;
+		std::condition_variable _inflight_cv;
+		void landed(void);
+
+		// Messages queued up by the reply callbacks themselves. The
+		// barrier has to go around again, if there were any.
+		static thread_local bool _in_reply;
+		std::atomic<size_t> _requeued{0};
+		void drain_pipes();
+
+		// Streamed replies are handed out about this many bytes at
+		// a time.
+		size_t _window;
 
 	public:
 		CogChannel(void);
@@ -130,14 +367,49 @@ class CogChannel
 		bool connected(void); // connection to DB is alive
 
 		void enqueue(Client*, const std::string&, Data&,
-		             void (Client::*)(const std::string&, const Data&));
-		void enqueue_noreply(const std::string&);
+		             void (Client::*)(const std::string&, const Data&),
+		             size_t nreplies = 1, size_t affinity = 0,
+		             bool unique = false);
+		void enqueue_stream(Client*, const std::string&, Data&,
+		             void (Client::*)(const std::string&, const Data&),
+		             bool unique = false);
+		void enqueue_fetch(Client*, const std::string&, Data&,
+		             void (Client::*)(const std::string&, const Data&),
+		             size_t nreplies = 1, size_t affinity = 0,
+		             bool unique = false);
+		void enqueue_fetch_stream(Client*, const std::string&, Data&,
+		             void (Client::*)(const std::string&, const Data&),
+		             bool unique = false);
+		void enqueue_noreply(const std::string&, size_t affinity = 0);
 		void synchro(Client*, const std::string&, Data&,
 		             void (Client::*)(const std::string&, Data&));
 
 		void barrier();
 		void flush();
 
+		void set_pipeline(size_t depth) { _pipeline = depth; }
+		size_t get_pipeline(void) const { return _pipeline; }
+		void set_window(size_t bytes) { _window = bytes; }
+		size_t get_window(void) const { return _window; }
+		void set_shards(size_t);
+		size_t get_shards(void) const { return _shards.size(); }
+		void set_affinity(bool);
+		bool get_affinity(void) const { return _affinity; }
+		void set_readers(size_t);
+		size_t get_readers(void) const { return _nreaders; }
+		void set_threads(size_t);
+		size_t get_threads(void) const { return _nthreads; }
+		void set_watermarks(size_t high, size_t low);
+		void check_watermarks(void);
+		void set_rcvbuf(int bytes) { _rcvbuf = bytes; }
+		void set_idle(size_t secs) { _idle_secs = secs; }
+		void set_write_batch(size_t bytes) { _wbatch = bytes; }
+		void set_write_delay(size_t msecs) { _wdelay = msecs; }
+		void set_decoders(size_t ndec) { _ndecode = ndec; }
+		void set_error_handler(
+			bool (Client::*eh)(const std::exception_ptr&, const Data&))
+			{ _on_error = eh; }
+
 		void clear_stats();
 		std::string print_stats();
 };
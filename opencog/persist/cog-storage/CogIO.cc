@@ -26,6 +26,7 @@
 #include <opencog/atoms/base/Atom.h>
 #include <opencog/atoms/base/Node.h>
 #include <opencog/atoms/base/Link.h>
+#include <opencog/atoms/value/FloatValue.h>
 #include <opencog/atomspace/AtomSpace.h>
 #include <opencog/persist/sexpr/Sexpr.h>
 
@@ -79,26 +80,103 @@ void CogStorage::set_proxy(const Handle& h)
 	_io_queue.barrier();
 }
 
-void CogStorage::storeAtom(const Handle& h, bool synchronous)
+static std::string set_values_msg(const Handle& h)
 {
-	CHECK_OPEN;
-	std::string msg;
 	if (h->haveValues())
-		msg = "(cog-set-values! " + Sexpr::encode_atom(h) +
+		return "(cog-set-values! " + Sexpr::encode_atom(h) +
 			Sexpr::encode_atom_values(h) + ")\n";
-	else
-		// There is no "just create an atom with no values on it"
-		// message type in the protocol. So instead, we clobber the
-		// truth value on it. This is fully 100% backwards compat.
-		msg = "(cog-set-value! " + Sexpr::encode_atom(h) +
-			"(Predicate \"*-TruthValueKey-*\") #f)\n";
 
-	_io_queue.enqueue_noreply(msg);
+	// There is no "just create an atom with no values on it"
+	// message type in the protocol. So instead, we clobber the
+	// truth value on it. This is fully 100% backwards compat.
+	return "(cog-set-value! " + Sexpr::encode_atom(h) +
+		"(Predicate \"*-TruthValueKey-*\") #f)\n";
+}
+
+static std::string set_value_msg(const Handle& h, const Handle& key)
+{
+	return "(cog-set-value! " + Sexpr::encode_atom(h) +
+		Sexpr::encode_atom(key) +
+		Sexpr::encode_value(h->getValue(key)) + ")\n";
+}
+
+static std::string value_msg(const Handle& h, const Handle& key)
+{
+	return "(cog-value " + Sexpr::encode_atom(h) +
+		Sexpr::encode_atom(key) + ")\n";
+}
+
+static std::string keys_msg(const Handle& h)
+{
+	return "(cog-keys->alist " + Sexpr::encode_atom(h) + ")\n";
+}
+
+void CogStorage::storeAtom(const Handle& h, bool synchronous)
+{
+	CHECK_OPEN;
+	cache_drop(h);
+	if (0 < _coalesce and not synchronous)
+	{
+		hold_write(h, Handle::UNDEFINED);
+		return;
+	}
+
+	if (holding()) flush_writes(h);
+	send_atom(h);
+}
+
+void CogStorage::send_atom(const Handle& h)
+{
+	_io_queue.enqueue_noreply(set_values_msg(h), h->get_hash());
+}
+
+// Many atoms, and all of their Values, in each message. That's fewer
+// messages to hash, de-duplicate and queue up here, and fewer socket
+// reads at the far end. In affinity mode, each atom has to go out on
+// its own socket, in order, so there, it's one message per atom.
+void CogStorage::storeAtoms(const HandleSeq& hs)
+{
+	CHECK_OPEN;
+
+	// Anything held back is older than what's about to be sent.
+	if (holding()) flush_writes();
+
+	if (_io_queue.get_affinity())
+	{
+		for (const Handle& h : hs)
+		{
+			cache_drop(h);
+			send_atom(h);
+		}
+		return;
+	}
+
+	std::string msg;
+	for (const Handle& h : hs)
+	{
+		cache_drop(h);
+		msg += set_values_msg(h);
+		if (_batch_bytes < msg.size())
+		{
+			_io_queue.enqueue_noreply(msg);
+			msg.clear();
+		}
+	}
+	if (0 < msg.size())
+		_io_queue.enqueue_noreply(msg);
 }
 
 void CogStorage::removeAtom(AtomSpace* frame, const Handle& h, bool recursive)
 {
 	CHECK_OPEN;
+	if (recursive) cache_clear();
+	else cache_drop(h);
+	if (holding())
+	{
+		if (recursive) flush_writes();
+		else flush_writes(h);
+	}
+
 	std::string msg;
 	if (recursive)
 		msg = "(cog-extract-recursive! " + Sexpr::encode_atom(h) + ")\n";
@@ -106,41 +184,375 @@ void CogStorage::removeAtom(AtomSpace* frame, const Handle& h, bool recursive)
 		msg = "(cog-extract! " + Sexpr::encode_atom(h) + ")\n";
 
 	Pkt pkt;
-	_io_queue.enqueue(this, msg, pkt, &CogStorage::noop_const);
+	_io_queue.enqueue(this, msg, pkt, &CogStorage::noop_const,
+		1, h->get_hash());
 }
 
-void CogStorage::storeValue(const Handle& h, const Handle& key)
+// Many deletes per message, with all of the replies coming back
+// together. In affinity mode, each atom has to go out on its own
+// socket, so that it stays in order with the stores to it; there,
+// it's one message per atom, but the waiting is still done just once.
+std::vector<bool> CogStorage::removeAtoms(AtomSpace* frame,
+                                          const HandleSeq& hs,
+                                          bool recursive)
 {
 	CHECK_OPEN;
+	if (holding()) flush_writes();
+	if (recursive) cache_clear();
+	else
+		for (const Handle& h : hs) cache_drop(h);
+	bool single = _io_queue.get_affinity();
+
+	DonePtr done = std::make_shared<Done>();
+	std::future<void> fut = done->p.get_future();
+
+	// One result vector per message; these are glued together at
+	// the end, after all of the replies are in.
+	std::vector<std::shared_ptr<std::vector<bool>>> batches;
+
+	std::string cmd = recursive ? "(cog-extract-recursive! " : "(cog-extract! ";
 	std::string msg;
-	msg = "(cog-set-value! " + Sexpr::encode_atom(h) +
-	      Sexpr::encode_atom(key) +
-	      Sexpr::encode_value(h->getValue(key)) + ")\n";
+	Pkt rpkt{nullptr, Handle::UNDEFINED, Handle::UNDEFINED, {}, {}, done};
+	for (size_t i=0; i<hs.size(); i++)
+	{
+		msg += cmd + Sexpr::encode_atom(hs[i]) + ")\n";
+		rpkt.hseq.push_back(hs[i]);
+		if (single or _batch_bytes < msg.size() or i+1 == hs.size())
+		{
+			rpkt.gone = std::make_shared<std::vector<bool>>();
+			batches.push_back(rpkt.gone);
+			_io_queue.enqueue(this, msg, rpkt, &CogStorage::decode_removed,
+				rpkt.hseq.size(), single ? hs[i]->get_hash() : 0, true);
+			msg.clear();
+			rpkt.hseq.clear();
+		}
+	}
+
+	// The promise is kept when the last packet goes away; drop ours.
+	rpkt.done = nullptr;
+	done = nullptr;
+	fut.get();
+
+	std::vector<bool> oks;
+	for (const auto& bs : batches)
+		oks.insert(oks.end(), bs->begin(), bs->end());
+	return oks;
+}
+
+void CogStorage::decode_removed(const std::string& reply, const Pkt& pkt)
+{
+	*pkt.gone = decode_bool_batch(pkt.hseq.size(), reply);
+}
+
+void CogStorage::storeValue(const Handle& h, const Handle& key)
+{
+	CHECK_OPEN;
+	cache_drop(h);
+	if (0 < _coalesce)
+	{
+		hold_write(h, key);
+		return;
+	}
 
-	_io_queue.enqueue_noreply(msg);
+	// Held deltas are older than this; they have to go out first,
+	// else they'd be added on top of it.
+	if (holding()) flush_writes(h);
+	_io_queue.enqueue_noreply(set_value_msg(h, key), h->get_hash());
+}
+
+// Write-combining. Repeated stores of the same Value on the same
+// atom are very common (e.g. counting), and almost all of them are
+// superceded before they would have gone out on the wire. So just
+// remember which (atom, key) pairs need to be written, and, when
+// the time comes, send whatever the Value is at that time. Writes
+// are flushed at barrier(), when too many have piled up, and before
+// any read or delete of the same atom.
+void CogStorage::hold_write(const Handle& h, const Handle& key)
+{
+	size_t nheld;
+	{
+		std::lock_guard<std::mutex> lck(_wc_mtx);
+		WriteSet& ws = _wc_pending[h];
+		if (key) ws.keys.insert(key);
+		else ws.all = true;
+		nheld = _wc_pending.size();
+	}
+	check_held(nheld);
+}
+
+static std::string update_value_msg(const Handle& h, const Handle& key,
+                                    const ValuePtr& delta)
+{
+	return "(cog-update-value! " + Sexpr::encode_atom(h) +
+		Sexpr::encode_atom(key) +
+		Sexpr::encode_value(delta) + ")\n";
+}
+
+// Delta-merging. Counting workloads send a stream of small increments
+// to the same few atoms. Add these together, and send just the sum.
+// Only FloatValues of the same length are summed; anything else is
+// sent right away, and the new delta is held in its place.
+void CogStorage::hold_delta(const Handle& h, const Handle& key,
+                            const ValuePtr& delta)
+{
+	size_t nheld;
+	ValuePtr unmerged;
+	{
+		std::lock_guard<std::mutex> lck(_wc_mtx);
+		WriteSet& ws = _wc_pending[h];
+		nheld = _wc_pending.size();
+
+		auto it = ws.deltas.find(key);
+		if (ws.deltas.end() == it)
+			ws.deltas.emplace(key, delta);
+		else
+		{
+			ValuePtr& held = it->second;
+			if (FLOAT_VALUE == held->get_type() and
+			    FLOAT_VALUE == delta->get_type() and
+			    FloatValueCast(held)->value().size() ==
+			    FloatValueCast(delta)->value().size())
+			{
+				std::vector<double> sum(FloatValueCast(held)->value());
+				const std::vector<double>& dv = FloatValueCast(delta)->value();
+				for (size_t i=0; i<sum.size(); i++) sum[i] += dv[i];
+				held = createFloatValue(std::move(sum));
+			}
+			else
+			{
+				unmerged = held;
+				held = delta;
+			}
+		}
+	}
+	if (unmerged)
+		_io_queue.enqueue_noreply(update_value_msg(h, key, unmerged),
+			h->get_hash());
+	check_held(nheld);
+}
+
+// Flush everything, if too many atoms are being held.
+void CogStorage::check_held(size_t nheld)
+{
+	if (std::max(_coalesce, _merge) <= nheld) flush_writes();
+}
+
+void CogStorage::send_writes(const Handle& h, const WriteSet& ws)
+{
+	// The queue sends update messages ahead of everything else;
+	// do the same here.
+	for (const auto& pr : ws.deltas)
+		_io_queue.enqueue_noreply(update_value_msg(h, pr.first, pr.second),
+			h->get_hash());
+
+	// All of the Values includes the keyed ones.
+	if (ws.all)
+	{
+		_io_queue.enqueue_noreply(set_values_msg(h), h->get_hash());
+		return;
+	}
+	for (const Handle& key : ws.keys)
+		_io_queue.enqueue_noreply(set_value_msg(h, key), h->get_hash());
+}
+
+/// Send the writes held for this atom. Returns false if there were
+/// none.
+bool CogStorage::flush_writes(const Handle& h)
+{
+	WriteSet ws;
+	{
+		std::lock_guard<std::mutex> lck(_wc_mtx);
+		auto it = _wc_pending.find(h);
+		if (_wc_pending.end() == it) return false;
+		ws = std::move(it->second);
+		_wc_pending.erase(it);
+	}
+	send_writes(h, ws);
+	return true;
+}
+
+void CogStorage::flush_writes(void)
+{
+	std::unordered_map<Handle, WriteSet> held;
+	{
+		std::lock_guard<std::mutex> lck(_wc_mtx);
+		held.swap(_wc_pending);
+	}
+	for (const auto& pr : held)
+		send_writes(pr.first, pr.second);
+}
+
+/// Send the writes held for the atoms about to be fetched, and make
+/// sure that the fetch can't overtake them. With affinity=1, the fetch
+/// goes down the same shard as the writes, behind them. Otherwise,
+/// nothing keeps the two in order: the fetch may go down the read
+/// lane, or down another shard. So wait for the writes to land.
+void CogStorage::flush_for_read(const HandleSeq& hs)
+{
+	bool flushed = false;
+	for (const Handle& h : hs)
+		if (flush_writes(h)) flushed = true;
+	if (flushed and not _io_queue.get_affinity())
+		_io_queue.barrier();
+}
+
+// Read cache. Every local write to an atom drops what was cached for
+// it, and bumps the generation. A reply to a request that went out
+// before the most recent drop might be older than that write, and so
+// it is not cached. This is cruder than tracking each atom, but it
+// only costs a miss, and read-heavy loads rarely see it. There is no
+// way to hear about writes made by other clients of the cogserver;
+// for those, the TTL is the only bound on staleness.
+uint64_t CogStorage::cache_gen(void)
+{
+	if (not caching()) return 0;
+	std::lock_guard<std::mutex> lck(_cache_mtx);
+	return _cache_gen;
+}
+
+bool CogStorage::cache_get(const Handle& h, const std::string& ask,
+                           std::string& reply)
+{
+	std::lock_guard<std::mutex> lck(_cache_mtx);
+	auto line = _cache.find(h->get_hash());
+	if (_cache.end() != line)
+	{
+		auto& replies = line->second.replies;
+		auto it = replies.find(ask);
+		if (replies.end() != it)
+		{
+			if (0 == _cache_ttl or Clock::now() - it->second.second <
+			                       std::chrono::milliseconds(_cache_ttl))
+			{
+				reply = it->second.first;
+				_cache_lru.splice(_cache_lru.begin(), _cache_lru,
+				                  line->second.lru);
+				_cache_hits++;
+				return true;
+			}
+			replies.erase(it);
+		}
+	}
+	_cache_misses++;
+	return false;
+}
+
+void CogStorage::cache_put(const Handle& h, const std::string& ask,
+                           const std::string& reply, uint64_t gen)
+{
+	std::lock_guard<std::mutex> lck(_cache_mtx);
+	if (gen < _cache_floor) return;
+
+	ContentHash ch = h->get_hash();
+	auto line = _cache.find(ch);
+	if (_cache.end() == line)
+	{
+		_cache_lru.push_front(ch);
+		line = _cache.emplace(ch, CacheLine{_cache_lru.begin(), {}}).first;
+		if (_cache_size < _cache.size())
+		{
+			_cache.erase(_cache_lru.back());
+			_cache_lru.pop_back();
+		}
+	}
+	else
+		_cache_lru.splice(_cache_lru.begin(), _cache_lru, line->second.lru);
+
+	// The replies for an atom overlap: the keys reply holds every
+	// Value, so it is older than any Value reply that comes after it,
+	// and vice versa. Keep only the newest copy of each Value.
+	auto& replies = line->second.replies;
+	if (0 == ask.compare(0, 16, "(cog-keys->alist"))
+		replies.clear();
+	else
+		replies.erase(keys_msg(h));
+
+	replies[ask] = {reply, Clock::now()};
+}
+
+void CogStorage::cache_drop(const Handle& h)
+{
+	if (not caching()) return;
+	std::lock_guard<std::mutex> lck(_cache_mtx);
+	_cache_floor = ++_cache_gen;
+	auto line = _cache.find(h->get_hash());
+	if (_cache.end() == line) return;
+	_cache_lru.erase(line->second.lru);
+	_cache.erase(line);
+}
+
+/// The bulk fetches bring in Values that are newer than what's in the
+/// cache; a later hit must not put the older ones back. These aren't
+/// local writes, so replies in flight are still good to keep.
+void CogStorage::cache_forget(const HandleSeq& hs)
+{
+	if (not caching()) return;
+	std::lock_guard<std::mutex> lck(_cache_mtx);
+	for (const Handle& h : hs)
+	{
+		auto line = _cache.find(h->get_hash());
+		if (_cache.end() == line) continue;
+		_cache_lru.erase(line->second.lru);
+		_cache.erase(line);
+	}
+}
+
+void CogStorage::cache_clear(void)
+{
+	if (not caching()) return;
+	std::lock_guard<std::mutex> lck(_cache_mtx);
+	_cache_floor = ++_cache_gen;
+	_cache.clear();
+	_cache_lru.clear();
 }
 
 void CogStorage::updateValue(const Handle& h, const Handle& key,
                              const ValuePtr& delta)
 {
 	CHECK_OPEN;
-	std::string msg;
-	msg = "(cog-update-value! " + Sexpr::encode_atom(h) +
-	      Sexpr::encode_atom(key) +
-	      Sexpr::encode_value(delta) + ")\n";
+	cache_drop(h);
+	if (0 < _merge)
+	{
+		hold_delta(h, key, delta);
+		return;
+	}
 
-	_io_queue.enqueue_noreply(msg);
+	_io_queue.enqueue_noreply(update_value_msg(h, key, delta), h->get_hash());
 }
 
 void CogStorage::loadValue(const Handle& h, const Handle& key)
+{
+	fetch_value(h, key, nullptr);
+}
+
+std::future<void> CogStorage::loadValueAsync(const Handle& h,
+                                             const Handle& key)
+{
+	DonePtr done = std::make_shared<Done>();
+	std::future<void> fut = done->p.get_future();
+	fetch_value(h, key, done);
+	return fut;
+}
+
+// Messages with something to wait on must not be de-duplicated,
+// else the duplicate's waiter would be released early.
+void CogStorage::fetch_value(const Handle& h, const Handle& key,
+                             const DonePtr& done)
 {
 	CHECK_OPEN;
-	std::string msg;
-	msg = "(cog-value " + Sexpr::encode_atom(h) +
-	      Sexpr::encode_atom(key) + ")\n";
+	if (holding()) flush_for_read({h});
+	std::string msg = value_msg(h, key);
 
-	Pkt pkta{nullptr, h, key};
-	_io_queue.enqueue(this, msg, pkta, &CogStorage::decode_value);
+	Pkt pkta{nullptr, h, key, {}, {}, done, nullptr, cache_gen()};
+	std::string reply;
+	if (caching() and cache_get(h, msg, reply))
+	{
+		pkta.gen = 0;  // Don't put it back.
+		decode_value(reply, pkta);
+		return;
+	}
+	_io_queue.enqueue_fetch(this, msg, pkta, &CogStorage::decode_value,
+		1, h->get_hash(), nullptr != done);
 }
 
 void CogStorage::decode_value(const std::string& reply, const Pkt& pkt)
@@ -155,48 +567,126 @@ void CogStorage::decode_value(const std::string& reply, const Pkt& pkt)
 		vp = Sexpr::add_atoms(as, vp);
 
 	pkt.h->setValue(pkt.key, vp);
+	if (0 < pkt.gen)
+		cache_put(pkt.h, value_msg(pkt.h, pkt.key), reply, pkt.gen);
 }
 
-void CogStorage::is_ok(const std::string& reply, Pkt& pkt)
+/// A reply callback threw. If someone is waiting on it, tell them,
+/// and return true; they own the error now. Only the first error is
+/// kept. Otherwise, it is left for the next barrier to rethrow.
+bool CogStorage::reply_error(const std::exception_ptr& ep, const Pkt& pkt)
 {
-	if (reply.compare(0, 2, "()"))
-		pkt.table = (AtomSpace *) -1;
+	if (nullptr == pkt.done) return false;
+	std::lock_guard<std::mutex> lck(pkt.done->mtx);
+	if (nullptr == pkt.done->err) pkt.done->err = ep;
+	return true;
 }
 
 void CogStorage::getAtom(const Handle& h)
 {
 	CHECK_OPEN;
-	std::string typena = nameserver().getTypeName(h->get_type()) + " ";
-	std::string iknow;
-	if (h->is_node())
+	if (holding()) flush_for_read({h});
+
+	// Get all of the keys. There's no need to first ask if the
+	// cogserver knows about this atom: if it doesn't, the reply is
+	// an empty list, just as it is for an atom with no values. That
+	// saves a round trip, and a synchronous one, at that.
+	std::string get_keys = keys_msg(h);
+
+	Pkt pkta{nullptr, h, Handle::UNDEFINED, {}, {}, nullptr, nullptr, cache_gen()};
+	std::string reply;
+	if (caching() and cache_get(h, get_keys, reply))
 	{
-		typena += "\"" + h->get_name() + "\"";
-		iknow = "(cog-node '" + typena + ")\n";
+		pkta.gen = 0;  // Don't put it back.
+		decode_kvp_list_const(reply, pkta);
+		return;
 	}
-	else
+	// _io_queue.synchro(this, get_keys, pkta, &CogStorage::decode_kvp_list);
+	_io_queue.enqueue_fetch(this, get_keys, pkta,
+		&CogStorage::decode_kvp_list_const, 1, h->get_hash());
+}
+
+// Ask for the keys on many atoms, in batches.
+void CogStorage::getAtoms(const HandleSeq& hs)
+{
+	CHECK_OPEN;
+	if (holding()) flush_for_read(hs);
+
+	bool single = _io_queue.get_affinity();
+	std::string get_keys;
+	Pkt kpkt{nullptr, Handle::UNDEFINED, Handle::UNDEFINED};
+	for (const Handle& h : hs)
 	{
-		for (const Handle& ho: h->getOutgoingSet())
-			typena += Sexpr::encode_atom(ho);
-		iknow = "(cog-link '" + typena + ")\n";
+		get_keys += "(cog-keys->alist " + Sexpr::encode_atom(h) + ")\n";
+		kpkt.hseq.push_back(h);
+		if (single or _batch_bytes < get_keys.size())
+		{
+			fetch_keys(get_keys, kpkt);
+			get_keys.clear();
+			kpkt.hseq.clear();
+		}
 	}
+	if (0 < kpkt.hseq.size())
+		fetch_keys(get_keys, kpkt);
+}
 
-	// Does the cogserver even know about this atom?
-	Pkt pkt;
-	_io_queue.synchro(this, iknow, pkt, &CogStorage::is_ok);
-	if (nullptr == pkt.table) return;
+void CogStorage::loadValues(const HandleSeq& hs, const Handle& key)
+{
+	loadValues(hs, HandleSeq(hs.size(), key));
+}
 
-	// Yes, the cogserver knows about this atom
-	// Get all of the keys.
-	std::string get_keys = "(cog-keys->alist (" + typena + "))\n";
+// Ask for many values, in batches, one batch per message.
+void CogStorage::loadValues(const HandleSeq& hs, const HandleSeq& keys)
+{
+	CHECK_OPEN;
+	if (hs.size() != keys.size())
+		throw IOException(TRACE_INFO, "Need one key per atom; got %zu for %zu",
+			keys.size(), hs.size());
+	if (holding()) flush_for_read(hs);
 
-	Pkt pkta{nullptr, h, Handle::UNDEFINED};
-	// _io_queue.synchro(this, get_keys, pkta, &CogStorage::decode_kvp_list);
-	_io_queue.enqueue(this, get_keys, pkta, &CogStorage::decode_kvp_list_const);
+	// With shard affinity, each atom must go down the same shard
+	// that its stores went down, else the read can overtake them.
+	bool single = _io_queue.get_affinity();
+	std::string msg;
+	Pkt vpkt{nullptr, Handle::UNDEFINED, Handle::UNDEFINED};
+	for (size_t i=0; i<hs.size(); i++)
+	{
+		msg += "(cog-value " + Sexpr::encode_atom(hs[i]) +
+		       Sexpr::encode_atom(keys[i]) + ")\n";
+		vpkt.hseq.push_back(hs[i]);
+		vpkt.kseq.push_back(keys[i]);
+		if (single or _batch_bytes < msg.size() or i+1 == hs.size())
+		{
+			_io_queue.enqueue_fetch(this, msg, vpkt, &CogStorage::decode_values,
+				vpkt.hseq.size(), single ? hs[i]->get_hash() : 0);
+			msg.clear();
+			vpkt.hseq.clear();
+			vpkt.kseq.clear();
+		}
+	}
+}
+
+void CogStorage::decode_values(const std::string& reply, const Pkt& pkt)
+{
+	decode_value_batch(pkt.hseq, pkt.kseq, reply);
+	cache_forget(pkt.hseq);
 }
 
 void CogStorage::decode_atom_list(const std::string& expr, const Pkt& pkt)
 {
 static std::unordered_map<std::string, Handle> _fid_map; // tmp placeholder
+	// Atom types that the cogserver does not know about get an
+	// error message, instead of a list. There's nothing to load.
+	if (0 == expr.size() or '(' != expr[0]) return;
+
+	// Rather than asking for the keys on each atom, one at a time,
+	// ask for them in batches: one message with many requests in it,
+	// with all of the replies coming back together.
+	bool single = _io_queue.get_affinity();
+	std::string get_keys;
+	Pkt kpkt{nullptr, Handle::UNDEFINED, Handle::UNDEFINED, {}, {}, pkt.done};
+	kpkt.bulk = pkt.bulk;
+
 	// Loop and decode atoms.
 	size_t l = expr.find('(') + 1; // skip the first paren.
 	size_t end = expr.rfind(')');  // trim tailing paren.
@@ -211,80 +701,334 @@ static std::unordered_map<std::string, Handle> _fid_map; // tmp placeholder
 		Handle h = add_nocheck(pkt.table, Sexpr::decode_atom(expr, l, r, 0, _fid_map));
 
 		// Get all of the keys.
-		std::string get_keys = "(cog-keys->alist " + expr.substr(l, r-l+1) + ")\n";
-		Pkt pkt{nullptr, h, Handle::UNDEFINED};
-		_io_queue.enqueue(this, get_keys, pkt, &CogStorage::decode_kvp_list_const);
+		get_keys += "(cog-keys->alist " + expr.substr(l, r-l+1) + ")\n";
+		kpkt.hseq.push_back(h);
+		if (single or _batch_bytes < get_keys.size())
+		{
+			fetch_keys(get_keys, kpkt);
+			get_keys.clear();
+			kpkt.hseq.clear();
+		}
 
 		// advance to next.
 		l = r+1;
 		r = end;
 	}
+	if (0 < kpkt.hseq.size())
+		fetch_keys(get_keys, kpkt);
+}
+
+/// Send a batch of `cog-keys->alist` requests, one per atom in
+/// the packet. With shard affinity, the callers send one atom per
+/// batch, and it goes down the shard that the atom's stores use.
+/// The keys for a bulk load stay with the bulk load, out of the
+/// read lane.
+void CogStorage::fetch_keys(const std::string& get_keys, Pkt& kpkt)
+{
+	size_t aff = 0;
+	if (_io_queue.get_affinity()) aff = kpkt.hseq[0]->get_hash();
+	if (kpkt.bulk)
+		_io_queue.enqueue(this, get_keys, kpkt, &CogStorage::decode_kvp_batch,
+			kpkt.hseq.size(), aff, nullptr != kpkt.done);
+	else
+		_io_queue.enqueue_fetch(this, get_keys, kpkt,
+			&CogStorage::decode_kvp_batch, kpkt.hseq.size(), aff,
+			nullptr != kpkt.done);
 }
 
 void CogStorage::fetchIncomingSet(AtomSpace* table, const Handle& h)
+{
+	fetch_incoming(table, h, nullptr);
+}
+
+std::future<void> CogStorage::fetchIncomingSetAsync(AtomSpace* table,
+                                                    const Handle& h)
+{
+	DonePtr done = std::make_shared<Done>();
+	std::future<void> fut = done->p.get_future();
+	fetch_incoming(table, h, done);
+	return fut;
+}
+
+void CogStorage::fetch_incoming(AtomSpace* table, const Handle& h,
+                                const DonePtr& done)
 {
 	CHECK_OPEN;
+	if (holding()) flush_writes();
 	std::string msg = "(cog-incoming-set " + Sexpr::encode_atom(h) + ")\n";
 
-	Pkt pkt{table, Handle::UNDEFINED, Handle::UNDEFINED,};
-	_io_queue.enqueue(this, msg, pkt, &CogStorage::decode_atom_list);
+	Pkt pkt{table, Handle::UNDEFINED, Handle::UNDEFINED, {}, {}, done};
+	_io_queue.enqueue_fetch_stream(this, msg, pkt,
+		&CogStorage::decode_atom_list, nullptr != done);
 }
 
 void CogStorage::fetchIncomingByType(AtomSpace* table, const Handle& h, Type t)
 {
 	CHECK_OPEN;
+	if (holding()) flush_writes();
 	std::string msg = "(cog-incoming-by-type " + Sexpr::encode_atom(h)
 		+ " '" + nameserver().getTypeName(t) + ")\n";
 
 	Pkt pkt{table, Handle::UNDEFINED, Handle::UNDEFINED,};
-	_io_queue.enqueue(this, msg, pkt, &CogStorage::decode_atom_list);
+	_io_queue.enqueue_fetch_stream(this, msg, pkt,
+		&CogStorage::decode_atom_list);
 }
 
-// FYI: Of the four sockts open to the cogserver, one of them will
-// handle the `cog-get-atoms` command, and will transfer not very
-// much data. The other three will transfer huge amounts of data,
-// basically fetching the keys and values on each atom. So looking
+// FYI: The cogserver has no cursors; the `cog-get-atoms` reply is one
+// big list, arriving on one socket. It is decoded a piece at a time, as
+// it arrives (see `window=N` in configure()), and the keys and values for
+// each piece are fetched in batches, on the other sockets. So looking
 // at the server stats will make it look like one socket is bare
 // touched ... which is correct: its cause of this.
 void CogStorage::loadAtomSpace(AtomSpace* table)
 {
 	CHECK_OPEN;
+	if (holding()) flush_writes();
+	if (_load_by_type)
+	{
+		loadByType(table);
+		return;
+	}
+
 	// Get nodes and links separately, in an effort to get
 	// smaller replies.
 	Pkt pkt{table, Handle::UNDEFINED, Handle::UNDEFINED};
+	pkt.bulk = true;
 	std::string msg = "(cog-get-atoms 'Node #t)\n";
-	_io_queue.enqueue(this, msg, pkt, &CogStorage::decode_atom_list);
+	_io_queue.enqueue_stream(this, msg, pkt, &CogStorage::decode_atom_list);
 
 	_io_queue.flush();
 	msg = "(cog-get-atoms 'Link #t)\n";
-	_io_queue.enqueue(this, msg, pkt, &CogStorage::decode_atom_list);
+	_io_queue.enqueue_stream(this, msg, pkt, &CogStorage::decode_atom_list);
 
 	_io_queue.barrier();
 }
 
+// Ask for each atom type separately. The replies are smaller, and
+// they are spread over all of the sockets, so that several of them
+// are being received and decoded at the same time. Only the types
+// that the server actually has atoms of are asked for; it is asked
+// for that list first, with `cog-report-counts`.
+void CogStorage::loadByType(AtomSpace* table)
+{
+	Pkt pkt{table, Handle::UNDEFINED, Handle::UNDEFINED};
+	pkt.skipped = std::make_shared<std::vector<std::string>>();
+	_io_queue.enqueue(this, "(cog-report-counts)\n", pkt,
+		&CogStorage::decode_type_counts);
+
+	// The barrier also waits for the requests that the reply sends.
+	_io_queue.barrier();
+
+	// Atoms of types that were never loaded here can't be decoded.
+	// Everything else was loaded; don't pretend that these were too.
+	if (0 < pkt.skipped->size())
+	{
+		std::string names;
+		for (const std::string& name : *pkt.skipped) names += " " + name;
+		throw IOException(TRACE_INFO,
+			"Skipped atoms of types that are not loaded here:%s\n",
+			names.c_str());
+	}
+}
+
+/// Decode the `cog-report-counts` reply, an association list of
+/// type names and atom counts, e.g. `((ConceptNode . 3) (ListLink . 2))`,
+/// and ask for the atoms of each of those types, Nodes first. The
+/// replies are handled as they arrive, so some Links may be loaded
+/// before some Nodes. Each Link brings its own Nodes with it, so
+/// this is harmless. Type names that aren't known here are passed
+/// back in `pkt.skipped`; this runs on a worker thread, and there's
+/// no one here to throw to.
+void CogStorage::decode_type_counts(const std::string& reply,
+                                    const Pkt& pkt)
+{
+	// Cogservers without `cog-report-counts` reply with an error
+	// message. Fall back to asking for all Nodes, then all Links,
+	// as loadAtomSpace() does. Going through our own list of types
+	// would also ask for the abstract ones, which can have no atoms.
+	if (0 == reply.size() or '(' != reply[0])
+	{
+		Pkt lpkt{pkt.table, Handle::UNDEFINED, Handle::UNDEFINED};
+		lpkt.bulk = true;
+		_io_queue.enqueue_stream(this, "(cog-get-atoms 'Node #t)\n", lpkt,
+			&CogStorage::decode_atom_list);
+		_io_queue.enqueue_stream(this, "(cog-get-atoms 'Link #t)\n", lpkt,
+			&CogStorage::decode_atom_list);
+		return;
+	}
+
+	std::vector<Type> nodes, links;
+	size_t pos = 1;  // skip the first paren.
+	while (true)
+	{
+		size_t l = reply.find('(', pos);
+		if (std::string::npos == l) break;
+		size_t r = reply.find(')', l);
+		if (std::string::npos == r) break;
+		pos = r + 1;
+
+		size_t dot = reply.find(" . ", l);
+		if (r < dot) continue;
+		std::string name = reply.substr(l+1, dot-l-1);
+		if (0 == strtoul(reply.c_str() + dot + 3, nullptr, 10)) continue;
+
+		Type t = nameserver().getType(name);
+		if (NOTYPE == t) pkt.skipped->push_back(name);
+		else if (nameserver().isNode(t)) nodes.push_back(t);
+		else if (nameserver().isLink(t)) links.push_back(t);
+	}
+	get_atoms_of_types(nodes, links, pkt);
+}
+
+void CogStorage::get_atoms_of_types(const std::vector<Type>& nodes,
+                                    const std::vector<Type>& links,
+                                    const Pkt& pkt)
+{
+	Pkt lpkt{pkt.table, Handle::UNDEFINED, Handle::UNDEFINED};
+	lpkt.bulk = true;
+	for (Type t : nodes)
+	{
+		std::string msg = "(cog-get-atoms '" + nameserver().getTypeName(t) + ")\n";
+		_io_queue.enqueue_stream(this, msg, lpkt, &CogStorage::decode_atom_list);
+	}
+	for (Type t : links)
+	{
+		std::string msg = "(cog-get-atoms '" + nameserver().getTypeName(t) + ")\n";
+		_io_queue.enqueue_stream(this, msg, lpkt, &CogStorage::decode_atom_list);
+	}
+}
+
 // See note on loadAtomSpace(), immediately above.
 void CogStorage::loadType(AtomSpace* table, Type t)
 {
 	CHECK_OPEN;
+	if (holding()) flush_writes();
 	std::string msg = "(cog-get-atoms '" + nameserver().getTypeName(t) + ")\n";
 
 	Pkt pkt{table, Handle::UNDEFINED, Handle::UNDEFINED,};
-	_io_queue.enqueue(this, msg, pkt, &CogStorage::decode_atom_list);
+	pkt.bulk = true;
+	_io_queue.enqueue_stream(this, msg, pkt, &CogStorage::decode_atom_list);
+}
+
+// Don't bother with extra threads for fewer atoms than this.
+#define MIN_ENCODE_ATOMS 1000
+
+/// Make sure that there are at least `n` encoder threads. If one
+/// can't be started, the ones that were are kept; stop_encoders()
+/// joins them.
+void CogStorage::start_encoders(size_t n)
+{
+	std::lock_guard<std::mutex> lck(_enc_mtx);
+	while (_enc_threads.size() < n)
+		_enc_threads.push_back(std::thread(&CogStorage::encoder, this));
+}
+
+void CogStorage::stop_encoders(void)
+{
+	std::lock_guard<std::mutex> lck(_enc_mtx);
+	_enc_q.cancel();
+	for (std::thread& t : _enc_threads) t.join();
+	_enc_threads.clear();
+	_enc_q.cancel_reset();
+}
+
+void CogStorage::encoder(void)
+{
+	while (true)
+	{
+		std::function<void()> job;
+		try { _enc_q.pop(job); }
+		catch (concurrent_queue<std::function<void()>>::Canceled& e)
+		{
+			return;
+		}
+		job();
+	}
 }
 
+// Encoding the atoms into strings is the slow part; the sockets wait
+// on it. So split up the atoms, and encode them in several threads,
+// all feeding the queue at the same time. This thread does one part;
+// the encoder threads do the rest. Their jobs point at this stack
+// frame, so it can't be left until all of them have finished.
 void CogStorage::storeAtomSpace(const AtomSpace* table)
 {
 	CHECK_OPEN;
 	HandleSeq all_atoms;
 	table->get_handles_by_type(all_atoms, ATOM, true);
-	for (const Handle& h : all_atoms)
-		storeAtom(h);
+
+	size_t natoms = all_atoms.size();
+	size_t nenc = _encoders ? _encoders : _io_queue.get_threads();
+	nenc = std::max<size_t>(1, std::min(nenc, natoms / MIN_ENCODE_ATOMS));
+
+	std::mutex emtx;
+	std::condition_variable ecv;
+	size_t running = 0;
+	std::exception_ptr err;
+	auto encode = [&](size_t i)
+	{
+		try
+		{
+			auto begin = all_atoms.begin();
+			storeAtoms(HandleSeq(begin + i * natoms / nenc,
+			                     begin + (i+1) * natoms / nenc));
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lck(emtx);
+			if (nullptr == err) err = std::current_exception();
+		}
+	};
+
+	try
+	{
+		if (1 < nenc) start_encoders(nenc - 1);
+		for (size_t i=1; i<nenc; i++)
+		{
+			{
+				std::lock_guard<std::mutex> lck(emtx);
+				running++;
+			}
+			try
+			{
+				_enc_q.push([&, i]() {
+					encode(i);
+					std::lock_guard<std::mutex> lck(emtx);
+					if (0 == --running) ecv.notify_all();
+				});
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lck(emtx);
+				running--;
+				throw;
+			}
+		}
+	}
+	catch (...)
+	{
+		// Couldn't hand out every part. Do nothing more here; the
+		// parts that were handed out still have to be waited for.
+		std::lock_guard<std::mutex> lck(emtx);
+		if (nullptr == err) err = std::current_exception();
+	}
+
+	if (nullptr == err) encode(0);
+	{
+		std::unique_lock<std::mutex> lck(emtx);
+		ecv.wait(lck, [&]{ return 0 == running; });
+	}
+	if (err) std::rethrow_exception(err);
+
+	flush_writes();
 	_io_queue.barrier();
 }
 
 void CogStorage::kill_data(void)
 {
 	CHECK_OPEN;
+	cache_clear();
+	flush_writes();
 	_io_queue.barrier();
 	Pkt pkt;
 	_io_queue.enqueue(this, "(cog-atomspace-clear)\n",
@@ -299,12 +1043,40 @@ void CogStorage::decode_kvp_list_const(const std::string& reply, const Pkt& pkt)
 	Handle h = pkt.h;
 	// Sexpr::decode_alist(h, reply);
 	ro_decode_alist(pkt.table, h, reply);
+	if (0 < pkt.gen)
+		cache_put(h, keys_msg(h), reply, pkt.gen);
+}
+
+/// Decode a batch of key-value-pair association lists, one per
+/// line, attaching them to the atoms in the packet.
+void CogStorage::decode_kvp_batch(const std::string& reply, const Pkt& pkt)
+{
+	decode_alist_batch(pkt.table, pkt.hseq, reply);
+	cache_forget(pkt.hseq);
 }
 
 void CogStorage::runQuery(const Handle& query, const Handle& key,
                           const Handle& meta, bool fresh)
+{
+	run_query(query, key, meta, fresh, nullptr);
+}
+
+std::future<void> CogStorage::runQueryAsync(const Handle& query,
+                                            const Handle& key,
+                                            const Handle& meta, bool fresh)
+{
+	DonePtr done = std::make_shared<Done>();
+	std::future<void> fut = done->p.get_future();
+	run_query(query, key, meta, fresh, done);
+	return fut;
+}
+
+void CogStorage::run_query(const Handle& query, const Handle& key,
+                           const Handle& meta, bool fresh,
+                           const DonePtr& done)
 {
 	CHECK_OPEN;
+	if (holding()) flush_writes();
 	std::string msg = "(cog-execute-cache! " +
 		Sexpr::encode_atom(query) +
 		Sexpr::encode_atom(key);
@@ -316,6 +1088,7 @@ void CogStorage::runQuery(const Handle& query, const Handle& key,
 	}
 	msg += ")\n";
 
-	Pkt pkta{nullptr, query, key};
-	_io_queue.enqueue(this, msg, pkta, &CogStorage::decode_value);
+	Pkt pkta{nullptr, query, key, {}, {}, done};
+	_io_queue.enqueue_fetch(this, msg, pkta, &CogStorage::decode_value,
+		1, 0, nullptr != done);
 }
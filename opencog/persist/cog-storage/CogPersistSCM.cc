@@ -66,6 +66,8 @@ void CogPersistSCM::init(void)
 {
     define_scheme_primitive("cog-storage-open", &CogPersistSCM::do_open, this, "persist-cog");
     define_scheme_primitive("cog-storage-close", &CogPersistSCM::do_close, this, "persist-cog");
+    define_scheme_primitive("cog-storage-store-atoms", &CogPersistSCM::do_store_atoms, this, "persist-cog");
+    define_scheme_primitive("cog-storage-remove-atoms", &CogPersistSCM::do_remove_atoms, this, "persist-cog");
 }
 
 CogPersistSCM::~CogPersistSCM()
@@ -123,6 +125,30 @@ void CogPersistSCM::do_close(void)
     _storage = nullptr;
 }
 
+void CogPersistSCM::do_store_atoms(const HandleSeq& hs)
+{
+    if (nullptr == _storage)
+        throw RuntimeException(TRACE_INFO,
+             "cog-storage-store-atoms: Error: AtomSpace not connected to CogServer!");
+
+    _storage->storeAtoms(hs);
+}
+
+/// Returns the atoms that were removed from the cogserver.
+HandleSeq CogPersistSCM::do_remove_atoms(const HandleSeq& hs,
+                                         bool recursive)
+{
+    if (nullptr == _storage)
+        throw RuntimeException(TRACE_INFO,
+             "cog-storage-remove-atoms: Error: AtomSpace not connected to CogServer!");
+
+    std::vector<bool> oks = _storage->removeAtoms(_as.get(), hs, recursive);
+    HandleSeq gone;
+    for (size_t i = 0; i < hs.size(); i++)
+        if (oks[i]) gone.push_back(hs[i]);
+    return gone;
+}
+
 void opencog_persist_cog_init(void)
 {
 	static CogPersistSCM patty(nullptr);
@@ -52,6 +52,8 @@ public:
 
 	void do_open(const std::string&);
 	void do_close(void);
+	void do_store_atoms(const HandleSeq&);
+	HandleSeq do_remove_atoms(const HandleSeq&, bool);
 
 }; // class
 
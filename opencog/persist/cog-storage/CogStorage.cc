@@ -27,12 +27,14 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <climits>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
 #include <errno.h>
 
+#include <opencog/util/Logger.h>
 #include <opencog/persist/cog-types/atom_types.h>
 
 #include "CogStorage.h"
@@ -54,6 +56,7 @@ void CogStorage::init(const char * uri)
 	_uri = uri;
 
 	// Look for connection arguments
+	std::map<std::string, size_t> layout;
 	size_t parg = _uri.find('?');
 	if (_uri.npos != parg)
 	{
@@ -61,32 +64,174 @@ void CogStorage::init(const char * uri)
 		size_t pamp = args.find('&');
 		while (args.npos != pamp)
 		{
-			std::string pcfg = args.substr(0, pamp);
-
-			// Verify acceptable formats. (There are none at this time.)
-			throw IOException(TRACE_INFO,
-				"Unknown configuration %s", pcfg.c_str());
-
+			configure(args.substr(0, pamp), layout);
 			args = args.substr(pamp+1);
 			pamp = args.find('&');
 		}
 
 		// Check the last one too.
-		std::string pcfg = args;
+		configure(args, layout);
+	}
+	apply_layout(layout);
+}
+
+/// Apply the queue layout arguments, in an order that lets each one
+/// be checked against the ones it depends on: the shards against
+/// the thread count, the read lane against affinity mode, and so on.
+void CogStorage::apply_layout(const std::map<std::string, size_t>& layout)
+{
+	auto get = [&](const char* key, size_t& num) {
+		auto it = layout.find(key);
+		if (layout.end() == it) return false;
+		num = it->second;
+		return true;
+	};
+
+	size_t num;
+	if (get("threads", num)) _io_queue.set_threads(num);
+	if (get("affinity", num)) _io_queue.set_affinity(0 < num);
+	if (get("shards", num)) _io_queue.set_shards(num);
+	if (get("readers", num)) _io_queue.set_readers(num);
+
+	size_t high = 0, low = 0;
+	get("high", high);
+	get("low", low);
+	_io_queue.set_watermarks(high, low);
+
+	// The queue watermarks can only be checked as a pair.
+	_io_queue.check_watermarks();
+}
+
+/// Verify one `key=value` configuration argument taken from the URI.
+/// Most are applied right away; the queue layout is collected into
+/// `layout`, for apply_layout().
+void CogStorage::configure(const std::string& pcfg,
+                           std::map<std::string, size_t>& layout)
+{
+	size_t peq = pcfg.find('=');
+	std::string key = pcfg.substr(0, peq);
+	std::string val;
+	if (pcfg.npos != peq) val = pcfg.substr(peq+1);
+
+	char* end = nullptr;
+	unsigned long num = strtoul(val.c_str(), &end, 10);
+	bool is_num = (0 < val.size() and isdigit(val[0]) and '\0' == *end);
+
+	// Number of replies that may be outstanding on each socket.
+	if (0 == key.compare("pipeline") and is_num)
+		_io_queue.set_pipeline(num);
+
+	// Number of bytes of a bulk-load reply to decode at a time.
+	else if (0 == key.compare("window") and is_num and 0 < num)
+		_io_queue.set_window(num);
+
+	// Split bulk loads into one request per atom type.
+	else if (0 == key.compare("load-by-type") and is_num)
+		_load_by_type = (0 < num);
+
+	// Number of atoms with held-back writes. See hold_write().
+	else if (0 == key.compare("coalesce") and is_num)
+		_coalesce = num;
+
+	// Number of atoms with held-back deltas. See hold_delta().
+	else if (0 == key.compare("merge") and is_num)
+		_merge = num;
+
+	// Split the message queue, to cut lock contention.
+	else if (0 == key.compare("shards") and is_num)
+		layout[key] = num;
+
+	// Keep the messages about any one Atom in order.
+	else if (0 == key.compare("affinity") and is_num)
+		layout[key] = num;
+
+	// Number of worker threads, each with its own socket.
+	else if (0 == key.compare("threads") and is_num)
+		layout[key] = num;
+
+	// Queue watermarks: writers stall when the queue is too full.
+	else if (0 == key.compare("high") and is_num and 0 < num)
+		layout[key] = num;
+	else if (0 == key.compare("low") and is_num and 0 < num)
+		layout[key] = num;
+
+	// Size of the socket receive buffers. SO_RCVBUF takes an int.
+	else if (0 == key.compare("rcvbuf") and is_num and 0 < num)
+	{
+		if (INT_MAX < num)
+			throw IOException(TRACE_INFO,
+				"Receive buffer too large: %s", pcfg.c_str());
+		_io_queue.set_rcvbuf((int) num);
+	}
+
+	// Largest number of bytes of batched requests in one message.
+	else if (0 == key.compare("batch") and is_num and 0 < num)
+		_batch_bytes = num;
+
+	// Close sockets that have been idle for this many seconds.
+	else if (0 == key.compare("idle") and is_num)
+		_io_queue.set_idle(num);
+
+	// Threads that encode atoms in store-atomspace.
+	else if (0 == key.compare("encoders") and is_num)
+		_encoders = num;
+
+	// Gather up no-reply writes, and send them together.
+	else if (0 == key.compare("wbatch") and is_num)
+		_io_queue.set_write_batch(num);
+	else if (0 == key.compare("wdelay") and is_num)
+		_io_queue.set_write_delay(num);
+
+	// Worker threads just for the fetches.
+	else if (0 == key.compare("readers") and is_num)
+		layout[key] = num;
+
+	// Threads that hand the pipelined replies to the callbacks.
+	else if (0 == key.compare("decoders") and is_num)
+		_io_queue.set_decoders(num);
+
+	// Read cache: number of atoms, and how long replies stay good.
+	else if (0 == key.compare("cache") and is_num)
+		_cache_size = num;
+	else if (0 == key.compare("ttl") and is_num)
+		_cache_ttl = num;
+	else
 		throw IOException(TRACE_INFO,
 			"Unknown configuration %s", pcfg.c_str());
-	}
 }
 
 CogStorage::CogStorage(std::string uri) :
-	StorageNode(COG_STORAGE_NODE, std::move(uri))
+	StorageNode(COG_STORAGE_NODE, std::move(uri)),
+	_load_by_type(false),
+	_batch_bytes(MAX_BATCH_BYTES),
+	_encoders(0),
+	_coalesce(0),
+	_merge(0),
+	_cache_size(0),
+	_cache_ttl(0),
+	_cache_gen(1),
+	_cache_floor(0),
+	_cache_hits(0),
+	_cache_misses(0)
 {
+	_io_queue.set_error_handler(&CogStorage::reply_error);
 	init(_name.c_str());
 }
 
 CogStorage::~CogStorage()
 {
-	close();
+	// Errors from earlier async requests show up at the barrier in
+	// close(); there's no one left to tell, so just log them.
+	try { close(); }
+	catch (const std::exception& ex)
+	{
+		logger().warn("CogStorage: error while closing: %s", ex.what());
+	}
+	catch (...)
+	{
+		logger().warn("CogStorage: unknown error while closing");
+	}
+	stop_encoders();
 }
 
 void CogStorage::open(void)
@@ -104,9 +249,21 @@ void CogStorage::close(void)
 {
 	if (not connected()) return;
 
-	proxy_close();
-	_io_queue.barrier();
+	// The barrier rethrows errors from earlier async requests; the
+	// connection still has to be closed, before passing them on.
+	std::exception_ptr ep;
+	try
+	{
+		proxy_close();
+		flush_writes();
+		_io_queue.barrier();
+	}
+	catch (...) { ep = std::current_exception(); }
+
 	_io_queue.close_connection();
+	stop_encoders();
+	cache_clear();
+	if (ep) std::rethrow_exception(ep);
 }
 
 /* ================================================================== */
@@ -117,6 +274,7 @@ void CogStorage::close(void)
 ///
 void CogStorage::barrier(AtomSpace* as)
 {
+	flush_writes();
 	_io_queue.barrier();
 }
 
@@ -125,8 +283,24 @@ void CogStorage::barrier(AtomSpace* as)
 std::string CogStorage::monitor(void)
 {
 	// _io_queue.clear_stats();
-	return "CogStorageNode I/O Queue Stats:\n" +
+	std::string rs = "CogStorageNode I/O Queue Stats:\n" +
 		_io_queue.print_stats();
+	if (holding())
+	{
+		std::lock_guard<std::mutex> lck(_wc_mtx);
+		rs += "Held writes: " + std::to_string(_wc_pending.size()) +
+			"  Limit: " + std::to_string(std::max(_coalesce, _merge)) +
+			"\n";
+	}
+	if (caching())
+	{
+		std::lock_guard<std::mutex> lck(_cache_mtx);
+		rs += "Cached atoms: " + std::to_string(_cache.size()) +
+			"  Limit: " + std::to_string(_cache_size) +
+			"  Hits: " + std::to_string(_cache_hits) +
+			"  Misses: " + std::to_string(_cache_misses) + "\n";
+	}
+	return rs;
 }
 
 DEFINE_NODE_FACTORY(CogStorageNode, COG_STORAGE_NODE)
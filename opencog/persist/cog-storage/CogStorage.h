@@ -30,6 +30,17 @@
 #ifndef _OPENCOG_COG_STORAGE_H
 #define _OPENCOG_COG_STORAGE_H
 
+#include <chrono>
+#include <functional>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
 #include <opencog/persist/api/StorageNode.h>
 #include <opencog/persist/cog-types/atom_types.h>
 #include <opencog/persist/cog-storage/CogChannel.h>
@@ -40,21 +51,133 @@ namespace opencog
  *  @{
  */
 
+// Requests for many atoms are batched up into one message, so that
+// the replies come back in one round-trip. The batches are kept small
+// enough to fit into the socket buffers; otherwise, a lock-step client
+// blocked in send() would never get around to reading the replies,
+// and would deadlock the server. This is the default; the `batch=N`
+// URI argument can change it.
+#define MAX_BATCH_BYTES 8192
+
 class CogStorage : public StorageNode
 {
 	private:
 		void init(const char *);
+		// The queue layout arguments (threads, shards and so on)
+		// depend on one another. configure() only collects them;
+		// init() applies them, in a fixed order, after the rest.
+		void configure(const std::string&, std::map<std::string, size_t>&);
+		void apply_layout(const std::map<std::string, size_t>&);
 		std::string _uri;
 
+		// Fetches that the caller wants to wait on. The promise is
+		// kept when the last copy of the packet goes away: that is,
+		// once the reply, and anything else that the reply asked for
+		// (e.g. the keys on the atoms in an incoming set), have all
+		// been decoded. If any of that failed, the future throws.
+		struct Done
+		{
+			std::promise<void> p;
+			std::mutex mtx;
+			std::exception_ptr err;
+			~Done() {
+				if (err) p.set_exception(err);
+				else p.set_value();
+			}
+		};
+		typedef std::shared_ptr<Done> DonePtr;
+
 		struct Pkt
 		{
 			AtomSpace* table;
 			Handle h;
 			Handle key;
+			HandleSeq hseq;  // For batched requests
+			HandleSeq kseq;  // Keys, for batched value requests
+			DonePtr done;    // For the *Async() fetches
+			std::shared_ptr<std::vector<bool>> gone; // For removeAtoms()
+			uint64_t gen;    // Read cache generation; see cache_put()
+			bool bulk;       // Part of a bulk load; not a fetch
+			std::shared_ptr<std::vector<std::string>> skipped; // loadByType()
 		};
 
 		CogChannel<CogStorage, Pkt> _io_queue;
 
+		// Bulk-load one atom type at a time, instead of all the
+		// Nodes, and then all the Links.
+		bool _load_by_type;
+
+		// Largest batch of requests to put into one message. This is
+		// for all of them: key fetches, loads, removes and stores.
+		size_t _batch_bytes;
+
+		// Number of threads that encode the atoms in storeAtomSpace().
+		// Zero means one per worker thread. They are started the first
+		// time they are needed, and stay up until close().
+		size_t _encoders;
+		std::mutex _enc_mtx;
+		std::vector<std::thread> _enc_threads;
+		concurrent_queue<std::function<void()>> _enc_q;
+		void start_encoders(size_t);
+		void stop_encoders(void);
+		void encoder(void);
+
+		// Write-combining. Stores are held back here, and only the
+		// most recent Value is sent, when they are flushed. Holds at
+		// most `_coalesce` atoms; zero means send everything at once.
+		// Likewise, if `_merge` is not zero, then updateValue() deltas
+		// are held back, and are summed together, where possible.
+		size_t _coalesce;
+		size_t _merge;
+		bool holding(void) const { return 0 < _coalesce or 0 < _merge; }
+		struct WriteSet
+		{
+			bool all = false;  // storeAtom(): send all of the Values
+			HandleSet keys;    // storeValue(): send just these
+			std::map<Handle, ValuePtr> deltas; // updateValue()
+		};
+		std::mutex _wc_mtx;
+		std::unordered_map<Handle, WriteSet> _wc_pending;
+		void hold_write(const Handle&, const Handle&);
+		void hold_delta(const Handle&, const Handle&, const ValuePtr&);
+		void check_held(size_t);
+		void send_writes(const Handle&, const WriteSet&);
+		bool flush_writes(const Handle&);
+		void flush_writes(void);
+		void flush_for_read(const HandleSeq&);
+		void send_atom(const Handle&);
+
+		// Read cache. Replies to getAtom() and loadValue() are kept,
+		// so that asking again needs no round trip. They are grouped
+		// by atom, so that a local store can drop everything known
+		// about that atom. Holds at most `_cache_size` atoms; zero
+		// means no cache. Replies older than `_cache_ttl` msecs are
+		// not used; zero means they are good until the next store.
+		size_t _cache_size;
+		size_t _cache_ttl;
+		typedef std::chrono::steady_clock Clock;
+		struct CacheLine
+		{
+			std::list<ContentHash>::iterator lru;
+			std::unordered_map<std::string,
+				std::pair<std::string, Clock::time_point>> replies;
+		};
+		std::mutex _cache_mtx;
+		std::unordered_map<ContentHash, CacheLine> _cache;
+		std::list<ContentHash> _cache_lru; // Most recently used first.
+		uint64_t _cache_gen;
+		uint64_t _cache_floor;
+		size_t _cache_hits;
+		size_t _cache_misses;
+		bool caching(void) const { return 0 < _cache_size; }
+		uint64_t cache_gen(void);
+		bool cache_get(const Handle&, const std::string&, std::string&);
+		void cache_put(const Handle&, const std::string&,
+		               const std::string&, uint64_t);
+		void cache_drop(const Handle&);
+		void cache_forget(const HandleSeq&);
+		void cache_clear(void);
+
 		void noop_const(const std::string&, const Pkt&) {}
 		void noop(const std::string&, Pkt&) {}
 		void decode_atom_list(const std::string&, const Pkt&);
@@ -62,9 +185,27 @@ class CogStorage : public StorageNode
 		void decode_kvp_list_const(const std::string&, const Pkt&);
 		void decode_kvp_list(const std::string& s, Pkt& p)
 		{ decode_kvp_list_const(s, p); }
-		void is_ok(const std::string&, Pkt&);
+		void decode_kvp_batch(const std::string&, const Pkt&);
+		void fetch_keys(const std::string&, Pkt&);
+		bool reply_error(const std::exception_ptr&, const Pkt&);
+		void loadByType(AtomSpace*);
+		void decode_type_counts(const std::string&, const Pkt&);
+		void get_atoms_of_types(const std::vector<Type>&,
+		                        const std::vector<Type>&, const Pkt&);
+
+		void fetch_value(const Handle&, const Handle&, const DonePtr&);
+		void fetch_incoming(AtomSpace*, const Handle&, const DonePtr&);
+		void run_query(const Handle&, const Handle&,
+		               const Handle&, bool, const DonePtr&);
 
 		void ro_decode_alist(AtomSpace*, const Handle&, const std::string&);
+		void decode_alist_batch(AtomSpace*, const HandleSeq&,
+		                        const std::string&);
+		void decode_value_batch(const HandleSeq&, const HandleSeq&,
+		                        const std::string&);
+		void decode_values(const std::string&, const Pkt&);
+		std::vector<bool> decode_bool_batch(size_t, const std::string&);
+		void decode_removed(const std::string&, const Pkt&);
 
 	public:
 		CogStorage(std::string uri);
@@ -102,6 +243,29 @@ class CogStorage : public StorageNode
 		void storeAtomSpace(const AtomSpace*); // Store entire contents
 		void barrier(AtomSpace* = nullptr);
 
+		// Batched fetches and stores. Many atoms go out in one message,
+		// (and come back in one reply), instead of one message for each.
+		// The n'th key is fetched from the n'th atom.
+		void getAtoms(const HandleSeq&);
+		void storeAtoms(const HandleSeq&);
+		void loadValues(const HandleSeq& atoms, const HandleSeq& keys);
+		void loadValues(const HandleSeq& atoms, const Handle& key);
+
+		// Batched delete. Blocks until the cogserver has answered;
+		// the n'th entry is true if the n'th atom was removed there.
+		std::vector<bool> removeAtoms(AtomSpace*, const HandleSeq&,
+		                              bool recursive);
+
+		// Asynchronous fetches. The future becomes ready when the
+		// reply has arrived and has been decoded; there is no need
+		// for a barrier(), and no waiting for unrelated requests.
+		std::future<void> loadValueAsync(const Handle& atom,
+		                                 const Handle& key);
+		std::future<void> fetchIncomingSetAsync(AtomSpace*, const Handle&);
+		std::future<void> runQueryAsync(const Handle&, const Handle&,
+		                                const Handle& = Handle::UNDEFINED,
+		                                bool = false);
+
 		// Debugging and performance monitoring
 		std::string monitor(void);
 };
@@ -42,7 +42,20 @@
   If no hostname is specified, its assumed to be 'localhost'. If no port
   is specified, its assumed to be 17001.
 
+  Tuning arguments can be appended, as in cog://HOSTNAME/?pipeline=16
+  The supported arguments are:
+     pipeline=N -- allow up to N requests to be outstanding on the
+                   socket. Default is zero: wait for each reply.
+     window=N   -- decode bulk-load replies about N bytes at a time.
+                   The server still sends each list as one reply.
+                   Default is 65536.
+     rcvbuf=N   -- socket receive buffer size, in bytes.
+     batch=N    -- largest batch of requests in one message, in bytes,
+                   for key fetches, bulk fetches and removes.
+                   Default 8192.
+
   Examples of use with valid URL's:
      (cog-simple-open \"cog://localhost/\")
      (cog-simple-open \"cog://localhost:17001/\")
+     (cog-simple-open \"cog://localhost:17001/?pipeline=16\")
 ")
@@ -19,7 +19,8 @@
 	(string-append opencog-ext-path-persist-cog "libpersist-cog")
 	"opencog_persist_cog_init")
 
-(export cog-storage-close cog-storage-open)
+(export cog-storage-close cog-storage-open cog-storage-remove-atoms
+	cog-storage-store-atoms)
 
 ; --------------------------------------------------------------
 
@@ -31,6 +32,32 @@
     no longer be stored to or fetched from the CogServer.
 ")
 
+(set-procedure-property! cog-storage-store-atoms 'documentation
+"
+ cog-storage-store-atoms ATOM-LIST - store many atoms at once.
+    Send all of the atoms in ATOM-LIST, and all of the Values on them,
+    to the currently-open CogServer. This is the same as calling
+    `store-atom` on each, but many atoms go out in each message, and
+    so it is faster.
+
+    Example:
+       (cog-storage-store-atoms (cog-get-atoms 'Concept))
+")
+
+(set-procedure-property! cog-storage-remove-atoms 'documentation
+"
+ cog-storage-remove-atoms ATOM-LIST RECURSIVE - remove many atoms.
+    Remove all of the atoms in ATOM-LIST from the currently-open
+    CogServer, using many deletes per message. If RECURSIVE is #t,
+    then everything that contains them is removed, too. The local
+    AtomSpace is not changed. Returns a list of the atoms that were
+    removed from the CogServer; the others were not (e.g. because
+    they are still in the incoming set of some other atom.)
+
+    Example:
+       (cog-storage-remove-atoms (cog-get-atoms 'Concept) #t)
+")
+
 (set-procedure-property! cog-storage-open 'documentation
 "
  cog-storage-open URL - Open a connection to a CogServer.
@@ -42,7 +69,47 @@
   If no hostname is specified, its assumed to be 'localhost'. If no port
   is specified, its assumed to be 17001.
 
+  Tuning arguments can be appended, as in cog://HOSTNAME/?pipeline=16
+  The supported arguments are:
+     pipeline=N -- allow up to N requests to be outstanding on each
+                   socket. Default is zero: wait for each reply.
+     window=N   -- decode bulk-load replies about N bytes at a time.
+                   The server still sends each list as one reply.
+                   Default is 65536.
+     load-by-type=1 -- load-atomspace asks for one atom type at a
+                   time, spread over all sockets; only for the types
+                   the server has. Default is 0.
+     coalesce=N -- hold back writes to up to N atoms, sending only
+                   the latest Values at the next barrier. Default 0.
+     merge=N    -- hold back update-value deltas to up to N atoms,
+                   summing them, until the next barrier. Default 0.
+     shards=N   -- split the message queue into N pieces, to cut
+                   lock contention. At most the number of threads;
+                   default is 1.
+     affinity=1 -- keep the messages about any one Atom in order,
+                   on one socket. Default is 0.
+     threads=N  -- number of worker threads and sockets. Default 4.
+     high=N, low=N -- message queue watermarks.
+     rcvbuf=N   -- socket receive buffer size, in bytes.
+     batch=N    -- largest batch of requests in one message, in bytes,
+                   for key fetches, bulk fetches, removes and stores.
+                   Default 8192.
+     idle=T     -- close sockets idle for T seconds; re-open on demand.
+                   More are opened when the queue backs up, either way.
+     encoders=N -- encode atoms in N threads, in store-atomspace.
+                   Default is one per worker thread.
+     wbatch=N   -- send writes in batches of up to N bytes. Default 0.
+     wdelay=T   -- hold batched writes at most T msecs. Default 5.
+     readers=N  -- N more threads and sockets, just for fetches, so that
+                   they don't wait behind writes. Default 0.
+     decoders=N -- with pipeline=N, decode the replies in N more threads.
+                   Default 1.
+     cache=N    -- answer repeated fetches for up to N atoms locally.
+                   Writes by other clients are not seen. Default 0.
+     ttl=T      -- with cache=N, keep replies at most T msecs.
+
   Examples of use with valid URL's:
      (cog-storage-open \"cog://localhost/\")
      (cog-storage-open \"cog://localhost:17001/\")
+     (cog-storage-open \"cog://localhost:17001/?pipeline=16\")
 ")